@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * avi_writer.cpp - Indexed MJPEG AVI files
+ */
+
+#include "avi_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+/* Everything up to and including the "movi" fourcc, see header(). */
+static constexpr uint32_t kHeaderSize = 224;
+/* Where the "movi" fourcc is, which index offsets count from. */
+static constexpr uint32_t kMovi = 220;
+
+static constexpr uint32_t kHasIndex = 0x10;  // AVIF_HASINDEX
+static constexpr uint32_t kKeyFrame = 0x10;  // AVIIF_KEYFRAME
+
+static void put32(std::vector<uint8_t> &out, uint32_t value)
+{
+	for (unsigned int i = 0; i < 4; i++)
+		out.push_back(value >> (i * 8));
+}
+
+static void put16(std::vector<uint8_t> &out, uint16_t value)
+{
+	out.push_back(value);
+	out.push_back(value >> 8);
+}
+
+static void fourcc(std::vector<uint8_t> &out, const char *code)
+{
+	out.insert(out.end(), code, code + 4);
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t size)
+{
+	while (size) {
+		ssize_t ret = ::write(fd, data, size);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		data += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+/*
+ * RIFF "AVI " { LIST "hdrl" { avih, LIST "strl" { strh, strf } }, LIST "movi"
+ * { 00dc chunks }, idx1 }, with the sizes and counts as of now.
+ */
+static std::vector<uint8_t> header(float fps, uint32_t width, uint32_t height, uint32_t frames,
+				   uint32_t largest, uint32_t moviSize, uint32_t riffSize)
+{
+	std::vector<uint8_t> out;
+	out.reserve(kHeaderSize);
+
+	fourcc(out, "RIFF");
+	put32(out, riffSize);
+	fourcc(out, "AVI ");
+
+	fourcc(out, "LIST");
+	put32(out, 192);
+	fourcc(out, "hdrl");
+
+	fourcc(out, "avih");
+	put32(out, 56);
+	put32(out, std::lround(1000000 / fps)); // us per frame
+	put32(out, 0);       // max bytes per second
+	put32(out, 0);       // padding granularity
+	put32(out, kHasIndex);
+	put32(out, frames);
+	put32(out, 0);       // initial frames
+	put32(out, 1);       // streams
+	put32(out, largest); // suggested buffer size
+	put32(out, width);
+	put32(out, height);
+	for (unsigned int i = 0; i < 4; i++)
+		put32(out, 0);
+
+	fourcc(out, "LIST");
+	put32(out, 116);
+	fourcc(out, "strl");
+
+	fourcc(out, "strh");
+	put32(out, 56);
+	fourcc(out, "vids");
+	fourcc(out, "MJPG");
+	put32(out, 0);       // flags
+	put16(out, 0);       // priority
+	put16(out, 0);       // language
+	put32(out, 0);       // initial frames
+	put32(out, 1000);    // scale, rate / scale is frames per second
+	put32(out, std::lround(fps * 1000));
+	put32(out, 0);       // start
+	put32(out, frames);  // length
+	put32(out, largest);
+	put32(out, UINT32_MAX); // quality, default
+	put32(out, 0);       // sample size, varies
+	put16(out, 0);
+	put16(out, 0);
+	put16(out, width);
+	put16(out, height);
+
+	fourcc(out, "strf");
+	put32(out, 40);
+	put32(out, 40);      // BITMAPINFOHEADER size
+	put32(out, width);
+	put32(out, height);
+	put16(out, 1);       // planes
+	put16(out, 24);      // bits per pixel once decoded
+	fourcc(out, "MJPG");
+	put32(out, width * height * 3);
+	for (unsigned int i = 0; i < 4; i++)
+		put32(out, 0);
+
+	fourcc(out, "LIST");
+	put32(out, moviSize);
+	fourcc(out, "movi");
+
+	return out;
+}
+
+AviWriter::AviWriter(std::string const &path, float fps)
+	: path_(path), fps_(fps > 0 ? fps : 30), offset_(kHeaderSize), width_(0), height_(0), largest_(0)
+{
+	fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+
+	std::vector<uint8_t> placeholder = header(fps_, 0, 0, 0, 0, 4, kHeaderSize - 8);
+	if (!writeAll(fd_, placeholder.data(), placeholder.size())) {
+		::close(fd_);
+		throw std::runtime_error("failed to write " + path + ": " + strerror(errno));
+	}
+}
+
+AviWriter::~AviWriter()
+{
+	close();
+}
+
+bool AviWriter::write(const uint8_t *data, size_t size, unsigned int width, unsigned int height)
+{
+	if (!width_) {
+		width_ = width;
+		height_ = height;
+	}
+	return chunk(data, size);
+}
+
+bool AviWriter::skip(unsigned int frames)
+{
+	for (unsigned int i = 0; i < frames; i++) {
+		if (!chunk(nullptr, 0))
+			return false;
+	}
+	return true;
+}
+
+bool AviWriter::chunk(const uint8_t *data, size_t size)
+{
+	if (fd_ < 0)
+		return false;
+
+	/* Room for this chunk, its padding, and the index that follows. */
+	uint64_t end = offset_ + 8 + size + 1 + 8 + (index_.size() + 1) * 16;
+	if (end > UINT32_MAX)
+		return false;
+
+	std::vector<uint8_t> head;
+	fourcc(head, "00dc");
+	put32(head, size);
+	static const uint8_t pad = 0;
+	if (!writeAll(fd_, head.data(), head.size()) || !writeAll(fd_, data, size) ||
+	    ((size & 1) && !writeAll(fd_, &pad, 1))) {
+		std::cerr << "failed to write " << path_ << ": " << strerror(errno) << std::endl;
+		/* The file offset is now unknown, nothing more goes in. */
+		::close(fd_);
+		fd_ = -1;
+		return false;
+	}
+
+	index_.push_back({ (uint32_t)(offset_ - kMovi), (uint32_t)size });
+	offset_ += 8 + size + (size & 1);
+	if (size > largest_)
+		largest_ = size;
+	return true;
+}
+
+void AviWriter::close()
+{
+	if (fd_ < 0)
+		return;
+
+	std::vector<uint8_t> index;
+	index.reserve(8 + index_.size() * 16);
+	fourcc(index, "idx1");
+	put32(index, index_.size() * 16);
+	for (const IndexEntry &entry : index_) {
+		fourcc(index, "00dc");
+		put32(index, entry.size ? kKeyFrame : 0);
+		put32(index, entry.offset);
+		put32(index, entry.size);
+	}
+
+	uint64_t end = offset_ + index.size();
+	std::vector<uint8_t> final = header(fps_, width_, height_, index_.size(), largest_,
+					    offset_ - kMovi, end - 8);
+	if (!writeAll(fd_, index.data(), index.size()) ||
+	    pwrite(fd_, final.data(), final.size(), 0) != (ssize_t)final.size())
+		std::cerr << "failed to finish " << path_ << ": " << strerror(errno) << std::endl;
+
+	::close(fd_);
+	fd_ = -1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * A plain AVI 1.0 file with one MJPEG video stream and an idx1 index, which
+ * anything that plays video can seek in. The headers are written with
+ * placeholder sizes when the file is opened and filled in by close(), along
+ * with the index, so a file that was never closed has its frames but needs
+ * its index rebuilt. RIFF sizes are 32 bits: frames that would take the
+ * file past 4GB are refused.
+ */
+class AviWriter
+{
+public:
+	AviWriter(std::string const &path, float fps);
+	~AviWriter();
+
+	/* The first frame sets the size in the headers. Returns false on errors. */
+	bool write(const uint8_t *data, size_t size, unsigned int width, unsigned int height);
+	/* Empty chunks, which players show as a repeat of the previous frame. */
+	bool skip(unsigned int frames);
+
+	void close();
+
+	unsigned int frames() const { return index_.size(); }
+
+private:
+	struct IndexEntry
+	{
+		uint32_t offset; // from the "movi" fourcc
+		uint32_t size;
+	};
+
+	bool chunk(const uint8_t *data, size_t size);
+
+	std::string path_;
+	float fps_;
+	int fd_;
+	uint64_t offset_;
+	uint32_t width_;
+	uint32_t height_;
+	uint32_t largest_;
+	std::vector<IndexEntry> index_;
+};
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * buffer_pool.cpp - Dense, index addressed per-buffer bookkeeping
+ */
+
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <linux/dma-buf.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+using namespace libcamera;
+
+BufferPool::~BufferPool()
+{
+	clear();
+}
+
+unsigned int BufferPool::add(FrameBuffer *buffer)
+{
+	if (buffer->planes().size() > kMaxPlanes)
+		throw std::runtime_error("too many planes in buffer");
+
+	Entry entry = {};
+	entry.buffer = buffer;
+	entry.state = State::Free;
+	entry.planes = buffer->planes().size();
+	for (unsigned int i = 0; i < entry.planes; i++) {
+		const FrameBuffer::Plane &plane = buffer->planes()[i];
+		entry.plane[i] = { plane.fd.get(), plane.offset, plane.length };
+	}
+
+	unsigned int index = entries_.size();
+	buffer->setCookie(index);
+	entries_.push_back(std::move(entry));
+	return index;
+}
+
+void BufferPool::sync(const Entry &entry, uint64_t flags)
+{
+	for (unsigned int i = 0; i < entry.planes; i++) {
+		if (i && entry.plane[i].fd == entry.plane[i - 1].fd)
+			continue;
+
+		struct dma_buf_sync sync = { flags };
+		int ret;
+		do {
+			ret = ioctl(entry.plane[i].fd, DMA_BUF_IOCTL_SYNC, &sync);
+		} while (ret && (errno == EINTR || errno == EAGAIN));
+	}
+}
+
+std::vector<Span<uint8_t>> const &BufferPool::map(unsigned int index)
+{
+	std::lock_guard<std::mutex> locker(lock_);
+	Entry &entry = entries_[index];
+
+	if (entry.mapping.empty()) {
+		size_t length = 0;
+		for (unsigned int i = 0; i < entry.planes; i++) {
+			length += entry.plane[i].length;
+
+			/* Planes sharing a dmabuf are mapped once, from its start. */
+			if (i == entry.planes - 1 || entry.plane[i].fd != entry.plane[i + 1].fd) {
+				void *memory = mmap(NULL, length, PROT_READ, MAP_SHARED, entry.plane[i].fd, 0);
+				if (memory == MAP_FAILED) {
+					for (Span<uint8_t> &span : entry.mapping)
+						munmap(span.data(), span.size());
+					entry.mapping.clear();
+					throw std::runtime_error("failed to map buffer");
+				}
+				entry.mapping.push_back(Span<uint8_t>(static_cast<uint8_t *>(memory), length));
+				length = 0;
+			}
+		}
+	}
+
+	/* Non-coherent platforms need the CPU caches brought up to date. */
+	if (!entry.cpuAccess) {
+		sync(entry, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+		entry.cpuAccess = true;
+	}
+
+	return entry.mapping;
+}
+
+void BufferPool::endCpuAccess(unsigned int index)
+{
+	std::lock_guard<std::mutex> locker(lock_);
+	Entry &entry = entries_[index];
+
+	if (entry.cpuAccess) {
+		sync(entry, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		entry.cpuAccess = false;
+	}
+}
+
+unsigned int BufferPool::mapped() const
+{
+	std::lock_guard<std::mutex> locker(lock_);
+	unsigned int count = 0;
+	for (const Entry &entry : entries_)
+		count += !entry.mapping.empty();
+	return count;
+}
+
+void BufferPool::clear()
+{
+	std::lock_guard<std::mutex> locker(lock_);
+	for (Entry &entry : entries_) {
+		if (entry.cpuAccess)
+			sync(entry, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+		for (Span<uint8_t> &span : entry.mapping)
+			munmap(span.data(), span.size());
+	}
+	entries_.clear();
+}
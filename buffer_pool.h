@@ -0,0 +1,87 @@
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+/*
+ * The buffers of one camera configuration, each given a dense index as it
+ * is added. The index is also stored as the FrameBuffer's cookie and is the
+ * cookie of the request carrying the buffer, so everything kept per buffer
+ * is an array access from either of them. Entries sit in one contiguous
+ * array; the per-frame path touches nothing else.
+ *
+ * Nothing is mapped up front: the GPU and display paths never need it. A
+ * buffer is mapped read-only the first time a CPU consumer asks for it, and
+ * that also starts a DMA-BUF CPU access, which lasts until endCpuAccess()
+ * when the buffer goes back to the camera. The pool doesn't own the
+ * FrameBuffers, but it does own their mappings, which go with clear().
+ */
+class BufferPool
+{
+public:
+	static constexpr unsigned int kMaxPlanes = 3;
+
+	/* Checked by the owner on each transition, to catch a double release. */
+	enum class State : uint8_t {
+		Free,     // not with the camera or anyone downstream
+		Queued,   // in a request queued to the camera
+		Consumed, // completed, held by the pipeline until released
+	};
+
+	struct Plane
+	{
+		int fd;
+		uint32_t offset;
+		uint32_t length;
+	};
+
+	BufferPool() = default;
+	~BufferPool();
+
+	BufferPool(const BufferPool &) = delete;
+	BufferPool &operator=(const BufferPool &) = delete;
+
+	/* Returns the buffer's index, which becomes its cookie. */
+	unsigned int add(libcamera::FrameBuffer *buffer);
+	void clear();
+
+	unsigned int size() const { return entries_.size(); }
+	static unsigned int index(const libcamera::FrameBuffer *buffer) { return buffer->cookie(); }
+
+	libcamera::FrameBuffer *buffer(unsigned int index) const { return entries_[index].buffer; }
+	unsigned int planes(unsigned int index) const { return entries_[index].planes; }
+	const Plane &plane(unsigned int index, unsigned int plane) const { return entries_[index].plane[plane]; }
+
+	/*
+	 * One span per distinct dmabuf, the planes that share it together. Only
+	 * to be read until endCpuAccess(). Any thread.
+	 */
+	std::vector<libcamera::Span<uint8_t>> const &map(unsigned int index);
+	/* Done reading the buffer, if anyone did. Any thread. */
+	void endCpuAccess(unsigned int index);
+	/* Buffers mapped so far. */
+	unsigned int mapped() const;
+
+	State state(unsigned int index) const { return entries_[index].state; }
+	void setState(unsigned int index, State state) { entries_[index].state = state; }
+
+private:
+	struct Entry
+	{
+		libcamera::FrameBuffer *buffer;
+		State state;
+		unsigned int planes;
+		Plane plane[kMaxPlanes];
+		/* Under lock_. */
+		std::vector<libcamera::Span<uint8_t>> mapping;
+		bool cpuAccess;
+	};
+
+	void sync(const Entry &entry, uint64_t flags);
+
+	std::vector<Entry> entries_;
+	mutable std::mutex lock_;
+};
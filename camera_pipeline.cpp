@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * camera_pipeline.cpp - Configuration, buffers and requests of one camera
+ */
+
+#include "camera_pipeline.h"
+#include "preview.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <iostream>
+
+using namespace libcamera;
+
+CameraPipeline::CameraPipeline(unsigned int index, std::shared_ptr<Camera> camera)
+	: index_(index), camera_(std::move(camera)), acquired_(false)
+{
+	if (camera_->acquire())
+		throw std::runtime_error("failed to acquire camera " + camera_->id());
+	acquired_ = true;
+	std::cout << "Acquired Camera: " << camera_->id() << '\n';
+}
+
+CameraPipeline::~CameraPipeline()
+{
+	requests_.clear();
+	pool_.clear();
+	allocator_.reset();
+	if (acquired_)
+		camera_->release();
+}
+
+uint64_t CameraPipeline::timestamp(Request *request)
+{
+	auto ts = request->metadata().get(controls::SensorTimestamp);
+	return ts ? *ts : request->buffers().begin()->second->metadata().timestamp;
+}
+
+void CameraPipeline::requestComplete(Request *request)
+{
+	TRACE_SCOPE("requestComplete");
+	if (request->status() == Request::RequestCancelled)
+		return;
+
+	/* Only the viewfinder stream is configured, so one buffer per request. */
+	auto bufferPair = *request->buffers().begin();
+	unsigned int slot = request->cookie();
+	assert(pool_.state(slot) == BufferPool::State::Queued);
+	pool_.setState(slot, BufferPool::State::Consumed);
+	Frame frame = {
+		index_,
+		slot,
+		bufferPair.second,
+		&bufferPair.first->configuration(),
+		timestamp(request),
+		bufferPair.second->metadata().sequence,
+	};
+	completed_(frame);
+}
+
+/*
+ * Request i carries buffer i of every stream, so that the cookie indexes the
+ * viewfinder's BufferPool as well as requests_.
+ */
+void CameraPipeline::makeRequests()
+{
+	for (unsigned int i = 0; i < pool_.size(); i++)
+	{
+		std::unique_ptr<Request> request = camera_->createRequest(i);
+		if (!request)
+			throw std::runtime_error("failed to make request");
+
+		for (StreamConfiguration &cfg : *config_)
+		{
+			Stream *stream = cfg.stream();
+			const std::vector<std::unique_ptr<FrameBuffer>> &buffers = allocator_->buffers(stream);
+			if (buffers.size() != pool_.size())
+				throw std::runtime_error("concurrent streams need matching numbers of buffers");
+			if (request->addBuffer(stream, buffers[i].get()) < 0)
+				throw std::runtime_error("failed to add buffer to request");
+		}
+		requests_.push_back(std::move(request));
+	}
+	std::cout << "Requests created\n";
+}
+
+void CameraPipeline::configure(unsigned int width, unsigned int height, int bufferCount)
+{
+	config_ = camera_->generateConfiguration( { StreamRole::Viewfinder } );
+	if (!config_)
+		throw std::runtime_error("failed to generate viewfinder configuration");
+
+	/*
+	 * Applying the default configuration first only costs time: every
+	 * configure() reprograms the sensor and pipeline.
+	 */
+	StreamConfiguration &streamConfig = config_->at(0);
+	std::cout << "Default viewfinder configuration is: " << streamConfig.toString() << std::endl;
+
+	Size size(1280, 960);
+	auto area = camera_->properties().get(properties::PixelArrayActiveAreas);
+	if (width != 0 && height != 0) //width and height were input
+		size = Size(width, height);
+	else if (area)
+	{
+		// The idea here is that most sensors will have a 2x2 binned mode that
+		// we can pick up.
+		size = (*area)[0].size() / 2;
+		size.alignDownTo(2, 2); // YUV420 will want to be even
+		std::cout << "Viewfinder size chosen is " << size.toString() << std::endl;
+	}
+
+	streamConfig.pixelFormat = libcamera::formats::YUV420;
+	streamConfig.size = size;
+	streamConfig.bufferCount = bufferCount;
+
+	config_->validate();
+	std::cout << "Validated viewfinder configuration is: "
+		  << streamConfig.toString() << std::endl;
+
+	/*
+	 * Once we have a validated configuration, we can apply it to the
+	 * Camera.
+	 */
+	if (camera_->configure(config_.get()))
+		throw std::runtime_error("failed to configure " + camera_->id());
+	if (trace_)
+		trace_->mark(index_, StartupTrace::Configured);
+
+	/*
+	 * Any EGLImages imported from a previous configuration refer to buffers
+	 * that are about to be freed, and their addresses may be reused. At
+	 * startup nothing has been imported yet, so this doesn't touch the
+	 * display that is being set up alongside.
+	 */
+	invalidateBufferCache(index_);
+	requests_.clear();
+	pool_.clear();
+
+	allocator_ = std::make_unique<FrameBufferAllocator>(camera_);
+	for (StreamConfiguration &cfg : *config_) {
+		Stream *stream = cfg.stream();
+		if (allocator_->allocate(stream) < 0)
+			std::cerr << "Can't allocate buffers" << std::endl;
+
+		// Only the viewfinder buffers are ever seen downstream.
+		if (stream == config_->at(0).stream())
+		{
+			for (const std::unique_ptr<FrameBuffer> &buffer : allocator_->buffers(stream))
+				pool_.add(buffer.get());
+		}
+
+		size_t allocated = allocator_->buffers(cfg.stream()).size();
+		std::cout << "Allocated " << allocated << " buffers for stream" << std::endl;
+	}
+
+	makeRequests();
+	if (trace_)
+		trace_->mark(index_, StartupTrace::Allocated);
+}
+
+void CameraPipeline::start(const ControlList &controls)
+{
+	camera_->requestCompleted.connect(this, &CameraPipeline::requestComplete);
+	camera_->start(&controls);
+	for (unsigned int i = 0; i < requests_.size(); i++)
+	{
+		pool_.setState(i, BufferPool::State::Queued);
+		camera_->queueRequest(requests_[i].get());
+	}
+}
+
+void CameraPipeline::stop()
+{
+	camera_->stop();
+	camera_->requestCompleted.disconnect(this, &CameraPipeline::requestComplete);
+}
+
+/* Only CPU consumers map camera buffers. */
+void CameraPipeline::report() const
+{
+	if (pool_.mapped())
+		std::cout << "Camera " << index_ << ": " << pool_.mapped() << " of "
+			  << pool_.size() << " buffers mapped for CPU access" << std::endl;
+}
+
+void CameraPipeline::release(unsigned int slot)
+{
+	Request *request = requests_[slot].get();
+	/* Released twice, or never handed out: the request would be queued twice. */
+	assert(pool_.state(slot) == BufferPool::State::Consumed);
+	pool_.endCpuAccess(slot);
+	pool_.setState(slot, BufferPool::State::Queued);
+	request->reuse(Request::ReuseBuffers);
+	camera_->queueRequest(request);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "buffer_pool.h"
+#include "frame_source.h"
+
+/*
+ * Everything needed to run one camera: its configuration, buffers, requests
+ * and completion handling. simple-cam creates one per camera reported by the
+ * CameraManager and identifies them by index. Frame slots are request
+ * indices, which are also the request cookies and the BufferPool indices of
+ * the viewfinder buffers they carry.
+ */
+class CameraPipeline : public FrameSource
+{
+public:
+	CameraPipeline(unsigned int index, std::shared_ptr<libcamera::Camera> camera);
+	~CameraPipeline();
+
+	unsigned int index() const { return index_; }
+	libcamera::Camera *camera() const { return camera_.get(); }
+	const std::vector<std::unique_ptr<libcamera::Request>> &requests() const { return requests_; }
+	libcamera::StreamConfiguration const &streamConfiguration() const override { return config_->at(0); }
+
+	void configure(unsigned int width, unsigned int height, int bufferCount) override;
+	void start(const libcamera::ControlList &controls) override;
+	void stop() override;
+
+	unsigned int slots() const override { return requests_.size(); }
+	void release(unsigned int slot) override;
+	void report() const override;
+
+	std::vector<libcamera::Span<uint8_t>> const &mappedBuffer(libcamera::FrameBuffer *buffer) override
+	{
+		return pool_.map(BufferPool::index(buffer));
+	}
+
+	static uint64_t timestamp(libcamera::Request *request);
+
+private:
+	void requestComplete(libcamera::Request *request);
+	void makeRequests();
+
+	unsigned int index_;
+	std::shared_ptr<libcamera::Camera> camera_;
+	std::unique_ptr<libcamera::CameraConfiguration> config_;
+	std::unique_ptr<libcamera::FrameBufferAllocator> allocator_;
+	std::vector<std::unique_ptr<libcamera::Request>> requests_;
+	BufferPool pool_;
+	bool acquired_;
+};
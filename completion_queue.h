@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer, single-consumer ring (after Dmitry Vyukov's bounded
+ * queue). Storage is allocated once in the constructor, push() never blocks
+ * or allocates and is safe from any number of threads, pop() must only be
+ * called from the consuming thread. push() fails when the ring is full.
+ */
+template<typename T>
+class CompletionQueue
+{
+public:
+	explicit CompletionQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+
+		cells_ = std::make_unique<Cell[]>(size);
+		for (size_t i = 0; i < size; i++)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		mask_ = size - 1;
+		head_.store(0, std::memory_order_relaxed);
+		tail_ = 0;
+	}
+
+	size_t capacity() const { return mask_ + 1; }
+
+	bool push(const T &item)
+	{
+		size_t pos = head_.load(std::memory_order_relaxed);
+		Cell *cell;
+
+		for (;;) {
+			cell = &cells_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = item;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		Cell *cell = &cells_[tail_ & mask_];
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(tail_ + 1) < 0)
+			return false;
+
+		item = cell->data;
+		cell->sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+		tail_++;
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells_;
+	size_t mask_;
+
+	/* Producers and the consumer write different ends, keep them apart. */
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) size_t tail_;
+};
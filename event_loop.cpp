@@ -6,22 +6,41 @@
  */
 
 #include "event_loop.h"
-#include "preview.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <iostream>
 #include <algorithm>
+#include <errno.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 EventLoop *EventLoop::instance_ = nullptr;
 
 EventLoop::EventLoop()
+	: exit_(false), exitCode_(-1)
 {
 	assert(!instance_); 
 
 	evthread_use_pthreads();
 	event_ = event_base_new();
+
+	/*
+	 * Work posted from other threads is signalled through an eventfd, so
+	 * exec() can sleep in libevent until there is something to do. Writes
+	 * accumulate in the eventfd counter, which means a wakeup sent before
+	 * the loop starts waiting is never lost.
+	 */
+	wakeupFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeupFd_ < 0)
+		throw std::runtime_error("failed to create wakeup eventfd");
+	wakeup_ = event_new(event_, wakeupFd_, EV_READ | EV_PERSIST, &wakeupTriggered, this);
+	event_add(wakeup_, nullptr);
+
 	instance_ = this;
 }
 
@@ -29,52 +48,23 @@ EventLoop::~EventLoop()
 {
 	instance_ = nullptr;
 
+	for (Callback &callback : callbacks_)
+		event_free(callback.event);
+	event_free(wakeup_);
+	close(wakeupFd_);
 	event_base_free(event_);
 	libevent_global_shutdown();
 }
 
-int EventLoop::exec(int width, int height, int timeout)
+/* Returns at once if exit() was called before, such as during setup. */
+int EventLoop::exec()
 {
-	exitCode_ = -1;
-	exit_.store(false, std::memory_order_release);
-	auto start_time = std::chrono::high_resolution_clock::now();
-	auto lastTime = start_time;
-	int nFrames = 0;
-	int lastFrames = 0;
-	int droppedFrames = 0;
-
-	//while (!exit_.load(std::memory_order_acquire)) {
-	while(1) {
-		auto now = std::chrono::high_resolution_clock::now();
-		if (timeout > 0 && now - start_time > std::chrono::milliseconds(timeout*1000))
-			break;
-		//std::cout << calls_.size() << '\n';
-		if ((calls_.size() % 2 == 0) && (calls_.size() > 0)) {
-			if (calls_.size() > 2)
-				droppedFrames++;
-				
-			//std::cout << "calls_ size: " << calls_.size() << '\n';
-			
-			//std::cout << "displaying frames \n";
-			//std::cout << "here doing stuff \n";
-			dispatchCalls();
-			//event_base_loop(event_, EVLOOP_NO_EXIT_ON_EMPTY);
-			displayFrame(width, height);
-			nFrames++;
-			if (nFrames % 160 == 0)
-			{ // Log FPS
-				auto currentTime = std::chrono::high_resolution_clock::now();
-				int elapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastTime).count();
-				float elapsedS = (float)elapsedMS / 1000;
-				lastTime = currentTime;
-				int frames = (nFrames - lastFrames);
-				lastFrames = nFrames;
-				float fps = frames / elapsedS;
-				printf("%d frames over %.2fs (%.1ffps)! \n", frames, elapsedS, fps);
-				printf("%d dropped frames over %.2fs! \n", droppedFrames, elapsedS);
-				droppedFrames = 0;
-			}
-		}
+	while (!exit_.load(std::memory_order_acquire)) {
+		dispatchCalls();
+		if (wakeupHandler_)
+			wakeupHandler_();
+		/* Sleep until callLater(), the timeout or exit() wakes us. */
+		event_base_loop(event_, EVLOOP_ONCE);
 	}
 
 	return exitCode_;
@@ -89,7 +79,17 @@ void EventLoop::exit(int code)
 
 void EventLoop::interrupt()
 {
-	event_base_loopbreak(event_);
+	/* Safe from any thread, and never blocks unless the counter overflows. */
+	uint64_t one = 1;
+	if (write(wakeupFd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		std::cerr << "failed to wake event loop" << std::endl;
+}
+
+void EventLoop::wakeupTriggered(int fd, short event, void *arg)
+{
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		std::cerr << "failed to read wakeup eventfd" << std::endl;
 }
 
 
@@ -110,6 +110,54 @@ void EventLoop::timeout(unsigned int sec)
 	evtimer_add(ev, &tv);
 }
 
+void EventLoop::callbackTriggered(int fd, short event, void *arg)
+{
+	Callback *callback = static_cast<Callback *>(arg);
+	callback->func();
+}
+
+/* Run func on the loop thread every sec seconds until the loop is destroyed. */
+void EventLoop::addTimer(unsigned int sec, const std::function<void()> &func)
+{
+	struct timeval tv;
+
+	tv.tv_sec = sec;
+	tv.tv_usec = 0;
+	callbacks_.push_back({ func, nullptr, false });
+	Callback &callback = callbacks_.back();
+	callback.event = event_new(event_, -1, EV_PERSIST, &callbackTriggered, &callback);
+	evtimer_add(callback.event, &tv);
+}
+
+/* Run func on the loop thread whenever fd becomes readable. */
+void EventLoop::addWatch(int fd, const std::function<void()> &func)
+{
+	callbacks_.push_back({ func, nullptr, false });
+	Callback &callback = callbacks_.back();
+	callback.event = event_new(event_, fd, EV_READ | EV_PERSIST, &callbackTriggered, &callback);
+	event_add(callback.event, nullptr);
+}
+
+/*
+ * Stop watching fd, before it is closed. This may be called from the watch's
+ * own callback, so the callback is only freed from dispatchCalls().
+ */
+void EventLoop::removeWatch(int fd)
+{
+	for (auto it = callbacks_.begin(); it != callbacks_.end(); ++it) {
+		if (it->removed || event_get_fd(it->event) != fd)
+			continue;
+
+		event_del(it->event);
+		it->removed = true;
+		callLater([this, it]() {
+			event_free(it->event);
+			callbacks_.erase(it);
+		});
+		return;
+	}
+}
+
 void EventLoop::callLater(const std::function<void()> &func)
 {
 	{
@@ -123,6 +171,11 @@ void EventLoop::callLater(const std::function<void()> &func)
 void EventLoop::dispatchCalls()
 {
 	std::unique_lock<std::mutex> locker(lock_);
+	/* Runs on every wakeup, only worth a slice when there is work. */
+	if (calls_.empty())
+		return;
+
+	TRACE_SCOPE("dispatchCalls");
 	for (auto iter = calls_.begin(); iter != calls_.end(); ) {
 		std::function<void()> call = std::move(*iter);
 		iter = calls_.erase(iter);
@@ -14,22 +14,45 @@ public:
 	~EventLoop();
 
 	void exit(int code = 0);
-	int exec(int width, int height, int timeout);
+	int exec();
 
 	void timeout(unsigned int sec);
+	void addTimer(unsigned int sec, const std::function<void()> &func);
+	void addWatch(int fd, const std::function<void()> &func);
+	void removeWatch(int fd);
 	void callLater(const std::function<void()> &func);
 
+	/*
+	 * Lock-free alternative to callLater() for producers that keep their
+	 * own queue: wakeup() makes exec() run the handler on the loop thread.
+	 */
+	void onWakeup(const std::function<void()> &func) { wakeupHandler_ = func; }
+	void wakeup() { interrupt(); }
+
 private:
 	static EventLoop *instance_;
 
 	static void timeoutTriggered(int fd, short event, void *arg);
+	static void wakeupTriggered(int fd, short event, void *arg);
+	static void callbackTriggered(int fd, short event, void *arg);
+
+	struct Callback
+	{
+		std::function<void()> func;
+		struct event *event;
+		bool removed;
+	};
 
 	struct event_base *event_;
+	struct event *wakeup_;
+	int wakeupFd_;
 	std::atomic<bool> exit_;
 	int exitCode_;
 
 	std::list<std::function<void()>> calls_;
 	std::mutex lock_;
+	std::function<void()> wakeupHandler_;
+	std::list<Callback> callbacks_;
 
 	void interrupt();
 	void dispatchCalls();
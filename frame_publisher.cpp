@@ -0,0 +1,267 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * frame_publisher.cpp - Zero-copy frame sharing over a Unix socket
+ */
+
+#include "frame_publisher.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <stdexcept>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace libcamera;
+
+FramePublisher::FramePublisher(EventLoop &loop, std::string const &path, unsigned int cameras,
+			       unsigned int maxHeld, unsigned int timeoutMs)
+	: loop_(loop), path_(path), cameras_(cameras), maxHeld_(std::max(1u, maxHeld)),
+	  timeoutNs_(timeoutMs * 1000000ULL), sent_(0), skipped_(0), dropped_(0)
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("publish socket path too long: " + path_);
+	strcpy(addr.sun_path, path_.c_str());
+
+	/* Packets keep each message whole, so no framing is needed. */
+	listenFd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd_ < 0)
+		throw std::runtime_error("failed to create publish socket: " + std::string(strerror(errno)));
+
+	unlink(path_.c_str());
+	if (bind(listenFd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+	    listen(listenFd_, 8) < 0) {
+		int err = errno;
+		close(listenFd_);
+		throw std::runtime_error("failed to listen on " + path_ + ": " + strerror(err));
+	}
+
+	/* A quarter of the timeout apart, so nobody holds on much past it. */
+	timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	uint64_t period = std::max<uint64_t>(timeoutNs_ / 4, 10000000);
+	struct itimerspec spec = {};
+	spec.it_interval.tv_sec = period / 1000000000;
+	spec.it_interval.tv_nsec = period % 1000000000;
+	spec.it_value = spec.it_interval;
+	if (timerFd_ < 0 || timerfd_settime(timerFd_, 0, &spec, nullptr) < 0) {
+		int err = errno;
+		if (timerFd_ >= 0)
+			close(timerFd_);
+		close(listenFd_);
+		throw std::runtime_error("failed to create publish timer: " + std::string(strerror(err)));
+	}
+
+	loop_.addWatch(listenFd_, [this]() { accept(); });
+	loop_.addWatch(timerFd_, [this]() {
+		uint64_t expirations;
+		if (read(timerFd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+			expire();
+	});
+	std::cout << "Publishing frames on " << path_ << std::endl;
+}
+
+FramePublisher::~FramePublisher()
+{
+	stop();
+	loop_.removeWatch(timerFd_);
+	close(timerFd_);
+	loop_.removeWatch(listenFd_);
+	close(listenFd_);
+	unlink(path_.c_str());
+}
+
+void FramePublisher::stop()
+{
+	for (auto it = subscribers_.begin(); it != subscribers_.end(); )
+		it = disconnect(it);
+}
+
+PublisherStats FramePublisher::stats() const
+{
+	return { (unsigned int)subscribers_.size(), sent_, skipped_, dropped_ };
+}
+
+void FramePublisher::accept()
+{
+	int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	Subscriber subscriber = { fd, {}, {}, std::vector<unsigned int>(cameras_, 0) };
+	subscriber.described.resize(cameras_);
+	subscriber.held.resize(cameras_);
+	subscribers_.push_back(std::move(subscriber));
+	loop_.addWatch(fd, [this, fd]() { receive(fd); });
+	std::cout << "Subscriber connected to " << path_ << std::endl;
+}
+
+void FramePublisher::receive(int fd)
+{
+	auto it = subscribers_.begin();
+	while (it != subscribers_.end() && it->fd != fd)
+		++it;
+	if (it == subscribers_.end())
+		return;
+
+	while (true) {
+		PublishRelease message;
+		ssize_t ret = recv(fd, &message, sizeof(message), MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret <= 0) {
+			/* Closed, or broken: either way its frames are done with. */
+			std::cout << "Subscriber left " << path_ << std::endl;
+			disconnect(it);
+			return;
+		}
+
+		if (ret != sizeof(message) || message.type != PublishReleaseType ||
+		    message.camera >= cameras_ || message.index >= it->held[message.camera].size())
+			continue;
+
+		Held &held = it->held[message.camera][message.index];
+		if (!held.frame.buffer)
+			continue;
+
+		Frame frame = held.frame;
+		held = {};
+		it->holding[message.camera]--;
+		release_(frame);
+	}
+}
+
+/* Send the buffer's planes, once per subscriber. False if it must wait. */
+bool FramePublisher::describe(Subscriber &subscriber, const Frame &frame)
+{
+	std::vector<bool> &described = subscriber.described[frame.source];
+	if (described.size() <= frame.slot)
+		described.resize(frame.slot + 1, false);
+	if (described[frame.slot])
+		return true;
+
+	const std::vector<FrameBuffer::Plane> &planes = frame.buffer->planes();
+	PublishBuffer message = {};
+	message.type = PublishBufferType;
+	message.camera = frame.source;
+	message.index = frame.slot;
+	message.width = frame.config->size.width;
+	message.height = frame.config->size.height;
+	message.stride = frame.config->stride;
+	message.pixelFormat = frame.config->pixelFormat.fourcc();
+	message.planes = std::min<size_t>(planes.size(), 3);
+
+	int fds[3];
+	for (unsigned int i = 0; i < message.planes; i++) {
+		fds[i] = planes[i].fd.get();
+		message.offset[i] = planes[i].offset;
+		message.length[i] = planes[i].length;
+	}
+
+	struct iovec iov = { &message, sizeof(message) };
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(message.planes * sizeof(int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(message.planes * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, message.planes * sizeof(int));
+
+	if (sendmsg(subscriber.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		return false;
+
+	described[frame.slot] = true;
+	return true;
+}
+
+bool FramePublisher::expired(const Subscriber &subscriber, uint64_t now) const
+{
+	for (const std::vector<Held> &camera : subscriber.held) {
+		for (const Held &held : camera) {
+			if (held.frame.buffer && now - held.since > timeoutNs_)
+				return true;
+		}
+	}
+	return false;
+}
+
+void FramePublisher::expire()
+{
+	uint64_t now = latencyNow();
+	for (auto it = subscribers_.begin(); it != subscribers_.end(); ) {
+		if (!expired(*it, now)) {
+			++it;
+			continue;
+		}
+
+		std::cout << "Subscriber held a frame for too long, disconnecting" << std::endl;
+		dropped_++;
+		it = disconnect(it);
+	}
+}
+
+std::list<FramePublisher::Subscriber>::iterator FramePublisher::disconnect(std::list<Subscriber>::iterator it)
+{
+	loop_.removeWatch(it->fd);
+	close(it->fd);
+
+	for (std::vector<Held> &camera : it->held) {
+		for (Held &held : camera) {
+			if (held.frame.buffer)
+				release_(held.frame);
+		}
+	}
+
+	return subscribers_.erase(it);
+}
+
+unsigned int FramePublisher::publish(const Frame &frame)
+{
+	uint64_t now = latencyNow();
+	unsigned int holders = 0;
+
+	for (auto it = subscribers_.begin(); it != subscribers_.end(); ) {
+		Subscriber &subscriber = *it;
+		if (subscriber.holding[frame.source] >= maxHeld_) {
+			skipped_++;
+			++it;
+			continue;
+		}
+
+		PublishFrame message = { PublishFrameType, frame.source, frame.slot, frame.sequence, frame.timestamp };
+		if (!describe(subscriber, frame) ||
+		    send(subscriber.fd, &message, sizeof(message), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+			/* A full socket only costs this frame, anything else the subscriber. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				skipped_++;
+				++it;
+			} else {
+				it = disconnect(it);
+			}
+			continue;
+		}
+
+		std::vector<Held> &held = subscriber.held[frame.source];
+		if (held.size() <= frame.slot)
+			held.resize(frame.slot + 1, Held{});
+		held[frame.slot] = { frame, now };
+		subscriber.holding[frame.source]++;
+		sent_++;
+		holders++;
+		++it;
+	}
+
+	return holders;
+}
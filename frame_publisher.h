@@ -0,0 +1,133 @@
+#pragma once
+
+#include <functional>
+#include <list>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "frame_source.h"
+
+/*
+ * Wire format between FramePublisher and its subscribers, one struct per
+ * SOCK_SEQPACKET message. A buffer is described once per subscriber, with
+ * one dmabuf fd per plane attached as SCM_RIGHTS, before the first frame
+ * that uses it; after that frames only carry the buffer's index. Every frame
+ * received must be given back with a release message.
+ */
+enum PublishMessageType : uint32_t {
+	PublishBufferType = 1,  // publisher -> subscriber
+	PublishFrameType = 2,   // publisher -> subscriber
+	PublishReleaseType = 3, // subscriber -> publisher
+};
+
+struct PublishBuffer
+{
+	uint32_t type;
+	uint32_t camera;
+	uint32_t index;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // of the Y plane, U and V have half of it
+	uint32_t pixelFormat; // DRM fourcc, YUV420
+	uint32_t planes;
+	uint32_t offset[3];
+	uint32_t length[3];
+};
+
+struct PublishFrame
+{
+	uint32_t type;
+	uint32_t camera;
+	uint32_t index;
+	uint32_t sequence;
+	uint64_t timestamp; // sensor timestamp, CLOCK_MONOTONIC ns
+};
+
+struct PublishRelease
+{
+	uint32_t type;
+	uint32_t camera;
+	uint32_t index;
+};
+
+struct PublisherStats
+{
+	unsigned int subscribers;
+	uint64_t sent;    // frames handed to a subscriber
+	uint64_t skipped; // frames not offered to a subscriber still holding its share
+	uint64_t dropped; // subscribers disconnected for holding frames too long
+};
+
+/*
+ * Offers completed frames to other processes on this machine without
+ * copying them, over a Unix socket at the given path. Each subscriber
+ * holds a frame until it sends the release back, and the frame only goes
+ * back to its camera once every holder, here and in this process, is done
+ * with it.
+ *
+ * Capture never waits on a subscriber. One that holds its maximum number of
+ * frames of a camera, or whose socket is full, misses frames; one that keeps
+ * a frame past the timeout is disconnected and loses all its frames. That is
+ * checked on a timer rather than as frames arrive, since a subscriber that
+ * holds enough buffers stops the frames arriving at all.
+ *
+ * Everything runs on the event loop.
+ */
+class FramePublisher
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+
+	FramePublisher(EventLoop &loop, std::string const &path, unsigned int cameras,
+		       unsigned int maxHeld, unsigned int timeoutMs);
+	~FramePublisher();
+
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+
+	/* Returns how many subscribers now hold the frame. */
+	unsigned int publish(const Frame &frame);
+	/* Disconnect everyone, handing back all their frames. */
+	void stop();
+
+	PublisherStats stats() const;
+
+private:
+	struct Held
+	{
+		Frame frame;
+		uint64_t since; // latencyNow() when sent
+	};
+
+	struct Subscriber
+	{
+		int fd;
+		/* Per camera, by slot. */
+		std::vector<std::vector<bool>> described;
+		std::vector<std::vector<Held>> held;
+		std::vector<unsigned int> holding;
+	};
+
+	void accept();
+	void receive(int fd);
+	void expire();
+	bool describe(Subscriber &subscriber, const Frame &frame);
+	bool expired(const Subscriber &subscriber, uint64_t now) const;
+	std::list<Subscriber>::iterator disconnect(std::list<Subscriber>::iterator it);
+
+	EventLoop &loop_;
+	std::string path_;
+	int listenFd_;
+	int timerFd_;
+	unsigned int cameras_;
+	unsigned int maxHeld_;
+	uint64_t timeoutNs_;
+
+	std::list<Subscriber> subscribers_;
+	ReleaseHandler release_;
+
+	uint64_t sent_;
+	uint64_t skipped_;
+	uint64_t dropped_;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "startup_trace.h"
+
+/*
+ * A completed frame as the rest of the pipeline sees it. "slot" identifies
+ * the buffer within its source (for a camera, the request cookie) and is what
+ * gets handed back to FrameSource::release() once the frame is consumed.
+ * A null buffer marks an empty Frame.
+ */
+struct Frame
+{
+	unsigned int source;
+	unsigned int slot;
+	libcamera::FrameBuffer *buffer;
+	libcamera::StreamConfiguration const *config;
+	uint64_t timestamp; // sensor timestamp, CLOCK_MONOTONIC ns
+	uint32_t sequence;
+};
+
+/*
+ * Something that produces YUV420 frames into a fixed set of dmabuf-backed
+ * buffers: a libcamera camera (CameraPipeline) or a synthetic generator
+ * (SyntheticSource) for benchmarking without hardware.
+ */
+class FrameSource
+{
+public:
+	/* Called from the source's own thread, must not block or allocate. */
+	using CompletionHandler = std::function<void(const Frame &frame)>;
+
+	virtual ~FrameSource() = default;
+
+	void onComplete(const CompletionHandler &handler) { completed_ = handler; }
+	/* Marks the configure and allocate steps of bring-up. */
+	void setStartupTrace(StartupTrace *trace) { trace_ = trace; }
+
+	virtual void configure(unsigned int width, unsigned int height, int bufferCount) = 0;
+	virtual void start(const libcamera::ControlList &controls) = 0;
+	virtual void stop() = 0;
+
+	/* The stream's configuration, valid once configure() has returned. */
+	virtual libcamera::StreamConfiguration const &streamConfiguration() const = 0;
+
+	/* Number of frame slots, each may be in flight at most once. */
+	virtual unsigned int slots() const = 0;
+	/* Give a consumed frame's buffer back to the source. */
+	virtual void release(unsigned int slot) = 0;
+
+	/*
+	 * CPU view of a frame's buffer, which may be mapped on first use and
+	 * read-only. Any thread, valid until the frame is released.
+	 */
+	virtual std::vector<libcamera::Span<uint8_t>> const &mappedBuffer(libcamera::FrameBuffer *buffer) = 0;
+
+	/*
+	 * False when the buffers are plain memory rather than dmabufs, so EGL
+	 * and KMS can't import them and only mappedBuffer() works.
+	 */
+	virtual bool dmabuf() const { return true; }
+	/* Print the source's own counters at exit, if it has anything to say. */
+	virtual void report() const {}
+
+protected:
+	CompletionHandler completed_;
+	StartupTrace *trace_ = nullptr;
+};
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * frame_sync.cpp - Match frames across cameras by sensor timestamp
+ */
+
+#include "frame_sync.h"
+
+#include <algorithm>
+
+FrameSync::FrameSync(unsigned int cameras, uint64_t toleranceNs, unsigned int maxPending)
+	: pending_(cameras), set_(cameras, Frame{}), tolerance_(toleranceNs),
+	  maxPending_(std::max(maxPending, 1u)), stats_()
+{
+}
+
+void FrameSync::add(const Frame &frame)
+{
+	std::deque<Frame> &queue = pending_[frame.source];
+	queue.push_back(frame);
+
+	tryMatch();
+
+	/*
+	 * Don't sit on more than a couple of frames per camera while the
+	 * others catch up, otherwise the sensor runs out of buffers.
+	 */
+	while (queue.size() > maxPending_)
+		releaseFront(frame.source);
+}
+
+void FrameSync::flush()
+{
+	for (unsigned int i = 0; i < pending_.size(); i++) {
+		while (!pending_[i].empty())
+			releaseFront(i);
+	}
+}
+
+FrameSyncStats FrameSync::stats(bool reset)
+{
+	FrameSyncStats stats = stats_;
+	if (reset)
+		stats_ = {};
+	return stats;
+}
+
+void FrameSync::releaseFront(unsigned int camera)
+{
+	Frame frame = pending_[camera].front();
+	pending_[camera].pop_front();
+	stats_.released++;
+	if (release_)
+		release_(frame);
+}
+
+void FrameSync::tryMatch()
+{
+	auto ready = [this]() {
+		return std::none_of(pending_.begin(), pending_.end(),
+				    [](const std::deque<Frame> &q) { return q.empty(); });
+	};
+
+	while (ready()) {
+		uint64_t newest = 0;
+		uint64_t oldest = UINT64_MAX;
+		for (const std::deque<Frame> &queue : pending_) {
+			newest = std::max(newest, queue.front().timestamp);
+			oldest = std::min(oldest, queue.front().timestamp);
+		}
+
+		if (newest - oldest <= tolerance_) {
+			for (unsigned int i = 0; i < pending_.size(); i++) {
+				set_[i] = pending_[i].front();
+				pending_[i].pop_front();
+			}
+
+			stats_.matched++;
+			stats_.skewSum += newest - oldest;
+			stats_.skewMax = std::max(stats_.skewMax, newest - oldest);
+			if (match_)
+				match_(set_);
+			continue;
+		}
+
+		/*
+		 * Every camera has a frame at least as new as "newest", so anything
+		 * older than newest - tolerance can never be matched.
+		 */
+		for (unsigned int i = 0; i < pending_.size(); i++) {
+			while (!pending_[i].empty() &&
+			       pending_[i].front().timestamp + tolerance_ < newest)
+				releaseFront(i);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include "frame_source.h"
+
+struct FrameSyncStats
+{
+	uint64_t matched;   // complete sets handed to the match handler
+	uint64_t released;  // frames given back because they could not be paired
+	uint64_t skewMax;   // largest timestamp spread within a set (ns)
+	uint64_t skewSum;   // sum of spreads, divide by matched for the mean
+};
+
+/*
+ * Pairs completed frames from several cameras by sensor timestamp. A set is
+ * only emitted once every camera has a frame within tolerance of the others.
+ * Frames that can no longer be part of a set, because every other camera has
+ * already moved past them, are handed to the release handler straight away
+ * so they can be queued back to the camera.
+ */
+class FrameSync
+{
+public:
+	using MatchHandler = std::function<void(const std::vector<Frame> &)>;
+	using ReleaseHandler = std::function<void(const Frame &)>;
+
+	FrameSync(unsigned int cameras, uint64_t toleranceNs, unsigned int maxPending = 2);
+
+	void onMatch(const MatchHandler &handler) { match_ = handler; }
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+
+	void add(const Frame &frame);
+	void flush();
+
+	FrameSyncStats stats(bool reset = false);
+
+private:
+	void releaseFront(unsigned int camera);
+	void tryMatch();
+
+	std::vector<std::deque<Frame>> pending_;
+	std::vector<Frame> set_;
+	uint64_t tolerance_;
+	unsigned int maxPending_;
+
+	MatchHandler match_;
+	ReleaseHandler release_;
+	FrameSyncStats stats_;
+};
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * latency.cpp - Per-stage frame latency histograms
+ */
+
+#include "latency.h"
+
+#include <stdio.h>
+#include <time.h>
+
+uint64_t latencyNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+unsigned int LatencyHistogram::bucket(uint64_t us)
+{
+	if (us < 8)
+		return us;
+
+	unsigned int msb = 63 - __builtin_clzll(us);
+	unsigned int index = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+	return index < kBuckets ? index : kBuckets - 1;
+}
+
+uint64_t LatencyHistogram::bucketValue(unsigned int index)
+{
+	if (index < 8)
+		return index;
+
+	/* Report the middle of the bucket. */
+	unsigned int msb = index / 8 + 2;
+	uint64_t low = (uint64_t)(8 + index % 8) << (msb - 3);
+	return low + ((1ULL << (msb - 3)) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t us)
+{
+	buckets_[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+		;
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary() const
+{
+	uint32_t counts[kBuckets];
+	uint64_t total = 0;
+	for (unsigned int i = 0; i < kBuckets; i++) {
+		counts[i] = buckets_[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+
+	Summary summary = { total, 0, 0, max_.load(std::memory_order_relaxed) };
+	if (!total)
+		return summary;
+
+	uint64_t p50 = (total * 50 + 99) / 100;
+	uint64_t p99 = (total * 99 + 99) / 100;
+	uint64_t seen = 0;
+	bool found50 = false;
+	for (unsigned int i = 0; i < kBuckets; i++) {
+		if (!counts[i])
+			continue;
+		seen += counts[i];
+		if (!found50 && seen >= p50) {
+			summary.p50 = bucketValue(i);
+			found50 = true;
+		}
+		if (seen >= p99) {
+			summary.p99 = bucketValue(i);
+			break;
+		}
+	}
+
+	return summary;
+}
+
+void LatencyHistogram::reset()
+{
+	for (unsigned int i = 0; i < kBuckets; i++)
+		buckets_[i].store(0, std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+LatencyTracker::LatencyTracker(const std::vector<size_t> &slotsPerCamera)
+	: histograms_(slotsPerCamera.size())
+{
+	for (size_t count : slotsPerCamera)
+		timings_.emplace_back(count, FrameTiming{});
+}
+
+void LatencyTracker::record(unsigned int camera, const FrameTiming &t)
+{
+	LatencyHistogram *h = histograms_[camera].stages;
+	auto span = [](uint64_t from, uint64_t to) {
+		return to > from ? (to - from) / 1000 : 0;
+	};
+
+	h[SensorToComplete].record(span(t.sensor, t.completed));
+	h[CompleteToDispatch].record(span(t.completed, t.dispatched));
+	h[DispatchToImport].record(span(t.dispatched, t.imported));
+	h[ImportToSwap].record(span(t.imported, t.swapped));
+	if (t.flipped) {
+		h[SwapToFlip].record(span(t.swapped, t.flipped));
+		h[SensorToPhoton].record(span(t.sensor, t.flipped));
+	} else {
+		h[SensorToPhoton].record(span(t.sensor, t.swapped));
+	}
+}
+
+void LatencyTracker::report(const std::string &title, bool reset)
+{
+	static const char *names[StageCount] = {
+		"sensor->complete",
+		"complete->dispatch",
+		"dispatch->import",
+		"import->swap",
+		"swap->flip",
+		"sensor->photon",
+	};
+
+	printf("%s latency (us):\n", title.c_str());
+	for (unsigned int camera = 0; camera < histograms_.size(); camera++) {
+		for (unsigned int stage = 0; stage < StageCount; stage++) {
+			LatencyHistogram &histogram = histograms_[camera].stages[stage];
+			LatencyHistogram::Summary s = histogram.summary();
+			if (!s.count)
+				continue;
+			printf("  cam%u %-18s n=%-7llu p50=%-7llu p99=%-7llu max=%llu\n",
+			       camera, names[stage], (unsigned long long)s.count,
+			       (unsigned long long)s.p50, (unsigned long long)s.p99,
+			       (unsigned long long)s.max);
+			if (reset)
+				histogram.reset();
+		}
+	}
+}
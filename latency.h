@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* CLOCK_MONOTONIC in ns, the clock V4L2 (and so SensorTimestamp) uses. */
+uint64_t latencyNow();
+
+/*
+ * Log-linear histogram of microsecond values: exact below 8us, then 8
+ * buckets per power of two (worst case ~12% error), up to ~70 minutes.
+ * record() is lock-free and safe from any thread.
+ */
+class LatencyHistogram
+{
+public:
+	static constexpr unsigned int kBuckets = 240;
+
+	struct Summary
+	{
+		uint64_t count;
+		uint64_t p50; // us
+		uint64_t p99; // us
+		uint64_t max; // us
+	};
+
+	LatencyHistogram();
+
+	void record(uint64_t us);
+	Summary summary() const;
+	void reset();
+
+private:
+	static unsigned int bucket(uint64_t us);
+	static uint64_t bucketValue(unsigned int index);
+
+	std::atomic<uint32_t> buckets_[kBuckets];
+	std::atomic<uint64_t> max_;
+};
+
+/* When each step of a frame's trip to the screen happened, see latencyNow(). */
+struct FrameTiming
+{
+	uint64_t sensor;     // SensorTimestamp, start of exposure readout
+	uint64_t completed;  // libcamera completion callback
+	uint64_t dispatched; // picked up by the event loop
+	uint64_t imported;   // bound to a GL texture on the render thread
+	uint64_t swapped;    // eglSwapBuffers() returned
+	uint64_t flipped;    // on screen (page flip), 0 when not applicable
+};
+
+/*
+ * Per-camera, per-stage latency histograms. Timings are kept per frame
+ * slot (the request cookie for cameras), so stages recorded on different
+ * threads don't need any lookup structure.
+ */
+class LatencyTracker
+{
+public:
+	enum Stage {
+		SensorToComplete,
+		CompleteToDispatch,
+		DispatchToImport,
+		ImportToSwap,
+		SwapToFlip,
+		SensorToPhoton,
+		StageCount,
+	};
+
+	LatencyTracker(const std::vector<size_t> &slotsPerCamera);
+
+	FrameTiming &timing(unsigned int camera, unsigned int slot)
+	{
+		return timings_[camera][slot];
+	}
+
+	/* Fold a finished frame into the histograms. */
+	void record(unsigned int camera, const FrameTiming &timing);
+	void report(const std::string &title, bool reset);
+
+private:
+	struct CameraHistograms
+	{
+		LatencyHistogram stages[StageCount];
+	};
+
+	std::vector<std::vector<FrameTiming>> timings_;
+	std::vector<CameraHistograms> histograms_;
+};
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * mjpeg_encoder.cpp - Compress frames to MJPEG AVI files on a pool of threads
+ */
+
+#include "mjpeg_encoder.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include <algorithm>
+
+using namespace libcamera;
+
+/* Longer gaps are a restart rather than lost frames, and aren't filled. */
+static constexpr uint32_t kMaxFill = 1000;
+
+/* libjpeg's default error handler exits the process. */
+struct JpegError
+{
+	jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+	longjmp(reinterpret_cast<JpegError *>(cinfo->err)->jump, 1);
+}
+
+/* Compresses into a vector that keeps its capacity from frame to frame. */
+struct JpegOutput
+{
+	jpeg_destination_mgr mgr;
+	std::vector<uint8_t> *buffer;
+};
+
+static void jpegInit(j_compress_ptr cinfo)
+{
+	JpegOutput *out = reinterpret_cast<JpegOutput *>(cinfo->dest);
+	out->buffer->resize(std::max<size_t>(out->buffer->capacity(), 65536));
+	out->mgr.next_output_byte = out->buffer->data();
+	out->mgr.free_in_buffer = out->buffer->size();
+}
+
+static boolean jpegGrow(j_compress_ptr cinfo)
+{
+	/* Only called once the whole buffer is full. */
+	JpegOutput *out = reinterpret_cast<JpegOutput *>(cinfo->dest);
+	size_t used = out->buffer->size();
+	out->buffer->resize(used * 2);
+	out->mgr.next_output_byte = out->buffer->data() + used;
+	out->mgr.free_in_buffer = out->buffer->size() - used;
+	return TRUE;
+}
+
+static void jpegTerm(j_compress_ptr cinfo)
+{
+	JpegOutput *out = reinterpret_cast<JpegOutput *>(cinfo->dest);
+	out->buffer->resize(out->buffer->size() - out->mgr.free_in_buffer);
+}
+
+/*
+ * The planes go in as they are, without the colour conversion and
+ * downsampling libjpeg would otherwise do: YUV420 is already the 2x2
+ * subsampled YCbCr it wants. Raw data is read in whole 16 row, 16 column
+ * blocks, which is why the planes are padded to 16 columns, and rows past
+ * the bottom repeat the last one.
+ */
+static bool compress(jpeg_compress_struct &cinfo, JpegError &error, const uint8_t *yuv,
+		     unsigned int width, unsigned int height, unsigned int stride, int quality,
+		     std::vector<uint8_t> &buffer)
+{
+	JpegOutput out = { {}, &buffer };
+	out.mgr.init_destination = jpegInit;
+	out.mgr.empty_output_buffer = jpegGrow;
+	out.mgr.term_destination = jpegTerm;
+
+	if (setjmp(error.jump)) {
+		jpeg_abort_compress(&cinfo);
+		return false;
+	}
+
+	cinfo.dest = &out.mgr;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+	cinfo.do_fancy_downsampling = FALSE;
+#endif
+	cinfo.comp_info[0].h_samp_factor = 2;
+	cinfo.comp_info[0].v_samp_factor = 2;
+	for (unsigned int i = 1; i < 3; i++) {
+		cinfo.comp_info[i].h_samp_factor = 1;
+		cinfo.comp_info[i].v_samp_factor = 1;
+	}
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	unsigned int chromaStride = stride / 2;
+	unsigned int chromaHeight = height / 2;
+	const uint8_t *y = yuv;
+	const uint8_t *u = y + (size_t)stride * height;
+	const uint8_t *v = u + (size_t)chromaStride * chromaHeight;
+
+	JSAMPROW rows[3][16];
+	JSAMPARRAY planes[3] = { rows[0], rows[1], rows[2] };
+	while (cinfo.next_scanline < height) {
+		unsigned int top = cinfo.next_scanline;
+		for (unsigned int i = 0; i < 16; i++) {
+			unsigned int row = std::min(top + i, height - 1);
+			rows[0][i] = const_cast<uint8_t *>(y + (size_t)row * stride);
+		}
+		for (unsigned int i = 0; i < 8; i++) {
+			unsigned int row = std::min(top / 2 + i, chromaHeight - 1);
+			rows[1][i] = const_cast<uint8_t *>(u + (size_t)row * chromaStride);
+			rows[2][i] = const_cast<uint8_t *>(v + (size_t)row * chromaStride);
+		}
+		jpeg_write_raw_data(&cinfo, planes, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	return true;
+}
+
+/* Copy a plane and pad each row out to dstStride with its last pixel. */
+static void copyPlane(const uint8_t *src, unsigned int srcStride, uint8_t *dst, unsigned int dstStride,
+		      unsigned int width, unsigned int height)
+{
+	for (unsigned int y = 0; y < height; y++) {
+		memcpy(dst, src, width);
+		memset(dst + width, dst[width - 1], dstStride - width);
+		src += srcStride;
+		dst += dstStride;
+	}
+}
+
+/* Bytes a frame takes once its planes are padded, see copy(). */
+static size_t paddedSize(unsigned int width, unsigned int height)
+{
+	size_t stride = ((width & ~1u) + 15) & ~15u;
+	return stride * (height & ~1u) * 3 / 2;
+}
+
+MjpegEncoder::MjpegEncoder(std::string const &prefix, std::vector<StreamConfiguration> const &configs,
+			   float fps, int quality, unsigned int threads)
+	: quality_(std::min(100, std::max(1, quality))), stopping_(false), depth_(0), peakDepth_(0),
+	  encoded_(0), dropped_(0), failed_(0), filled_(0), bytes_(0)
+{
+	/* Leave a core for the event loop and one for rendering. */
+	unsigned int cpus = std::thread::hardware_concurrency();
+	count_ = threads ? threads : cpus > 2 ? cpus - 2 : 1;
+
+	/* One frame being encoded and one waiting for each thread. */
+	slots_ = count_ * 2;
+	jobs_.resize(slots_);
+	/* Zero filled now, so the first frames don't fault the pages in. */
+	size_t staging = 0;
+	for (StreamConfiguration const &config : configs)
+		staging = std::max(staging, paddedSize(config.size.width, config.size.height));
+	for (Job &job : jobs_)
+		job.yuv.resize(staging);
+	free_ = std::make_unique<CompletionQueue<unsigned int>>(slots_);
+	queued_ = std::make_unique<CompletionQueue<unsigned int>>(slots_);
+	for (unsigned int i = 0; i < slots_; i++)
+		free_->push(i);
+
+	for (unsigned int i = 0; i < configs.size(); i++) {
+		std::unique_ptr<Output> output = std::make_unique<Output>();
+		output->avi = std::make_unique<AviWriter>(prefix + "-cam" + std::to_string(i) + ".avi", fps);
+		output->tickets = 0;
+		output->next = 0;
+		output->sequence = 0;
+		output->started = false;
+		outputs_.push_back(std::move(output));
+	}
+}
+
+MjpegEncoder::~MjpegEncoder()
+{
+	stop();
+}
+
+void MjpegEncoder::start()
+{
+	stopping_ = false;
+	for (unsigned int i = 0; i < count_; i++)
+		threads_.emplace_back(&MjpegEncoder::run, this);
+}
+
+void MjpegEncoder::stop()
+{
+	if (threads_.empty())
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	cond_.notify_all();
+	for (std::thread &thread : threads_)
+		thread.join();
+	threads_.clear();
+
+	/* Every ticket has been written by now, the index can go in. */
+	for (std::unique_ptr<Output> &output : outputs_)
+		output->avi->close();
+}
+
+bool MjpegEncoder::encode(const Frame &frame, std::vector<Span<uint8_t>> const &mapping)
+{
+	if (frame.source >= outputs_.size())
+		return false;
+
+	YuvImage image = yuvImage(*frame.config, mapping);
+	if (!image.y)
+		return false;
+
+	unsigned int index;
+	if (!free_->pop(index)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	/* Only a stream reconfigured since the encoder was made can be larger. */
+	Job &job = jobs_[index];
+	if (job.yuv.size() < paddedSize(image.width, image.height)) {
+		failed_.fetch_add(1, std::memory_order_relaxed);
+		free_->push(index);
+		return false;
+	}
+
+	job.frame = frame;
+	job.image = image;
+	job.width = image.width & ~1u;
+	job.height = image.height & ~1u;
+	job.stride = (job.width + 15) & ~15u;
+	job.camera = frame.source;
+	job.sequence = frame.sequence;
+	job.ticket = outputs_[frame.source]->tickets++;
+	job.queued = latencyNow();
+	job.ok = false;
+
+	/* Only this thread adds to the depth, so the peak can't be missed. */
+	unsigned int depth = depth_.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (depth > peakDepth_.load(std::memory_order_relaxed))
+		peakDepth_.store(depth, std::memory_order_relaxed);
+
+	/* Both rings hold every index, so this can't fail. */
+	queued_->push(index);
+	{
+		/* Taking the lock keeps the wakeup from landing before an encoder waits. */
+		std::unique_lock<std::mutex> locker(lock_);
+	}
+	cond_.notify_one();
+	return true;
+}
+
+EncoderStats MjpegEncoder::stats() const
+{
+	return { encoded_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed),
+		 failed_.load(std::memory_order_relaxed), filled_.load(std::memory_order_relaxed),
+		 bytes_.load(std::memory_order_relaxed), peakDepth_.load(std::memory_order_relaxed),
+		 wait_.summary(), encode_.summary(), total_.summary() };
+}
+
+void MjpegEncoder::run()
+{
+	JpegError error;
+	jpeg_compress_struct cinfo;
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = jpegErrorExit;
+	jpeg_create_compress(&cinfo);
+
+	while (true) {
+		unsigned int index;
+		bool queued = false;
+		{
+			/* Whatever is queued still gets encoded once stopping. */
+			std::unique_lock<std::mutex> locker(lock_);
+			cond_.wait(locker, [this, &index, &queued]() {
+				queued = queued_->pop(index);
+				return queued || stopping_;
+			});
+		}
+		if (!queued)
+			break;
+
+		Job &job = jobs_[index];
+		uint64_t start = latencyNow();
+		wait_.record((start - job.queued) / 1000);
+		copy(job);
+		job.ok = compress(cinfo, error, job.yuv.data(), job.width, job.height, job.stride,
+				  quality_, job.jpeg);
+		encode_.record((latencyNow() - start) / 1000);
+		if (!job.ok)
+			failed_.fetch_add(1, std::memory_order_relaxed);
+
+		finish(index);
+	}
+
+	jpeg_destroy_compress(&cinfo);
+}
+
+/* Encoder thread: copy the held frame into the job's planes, then let it go. */
+void MjpegEncoder::copy(Job &job)
+{
+	const YuvImage &image = job.image;
+	size_t luma = (size_t)job.stride * job.height;
+	size_t chroma = (size_t)(job.stride / 2) * (job.height / 2);
+
+	copyPlane(image.y, image.stride, job.yuv.data(), job.stride, job.width, job.height);
+	copyPlane(image.u, image.stride / 2, job.yuv.data() + luma, job.stride / 2,
+		  job.width / 2, job.height / 2);
+	copyPlane(image.v, image.stride / 2, job.yuv.data() + luma + chroma, job.stride / 2,
+		  job.width / 2, job.height / 2);
+
+	job.image = {};
+	release_(job.frame);
+}
+
+/*
+ * Hands an encoded job to its camera's file, and writes out every job that
+ * is now due, in ticket order. The encoder holding a camera's lock does the
+ * writing for the others that finished meanwhile.
+ */
+void MjpegEncoder::finish(unsigned int index)
+{
+	Output &output = *outputs_[jobs_[index].camera];
+	std::unique_lock<std::mutex> locker(output.lock);
+	output.done[jobs_[index].ticket] = index;
+
+	while (!output.done.empty() && output.done.begin()->first == output.next) {
+		unsigned int due = output.done.begin()->second;
+		output.done.erase(output.done.begin());
+		output.next++;
+
+		/* A failed frame is left as a gap for the next one to fill. */
+		Job &job = jobs_[due];
+		if (job.ok) {
+			uint32_t gap = job.sequence - output.sequence - 1;
+			if (output.started && gap && gap < kMaxFill && output.avi->skip(gap))
+				filled_.fetch_add(gap, std::memory_order_relaxed);
+
+			if (output.avi->write(job.jpeg.data(), job.jpeg.size(), job.width, job.height)) {
+				encoded_.fetch_add(1, std::memory_order_relaxed);
+				bytes_.fetch_add(job.jpeg.size(), std::memory_order_relaxed);
+				output.started = true;
+				output.sequence = job.sequence;
+			} else
+				failed_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		total_.record((latencyNow() - job.queued) / 1000);
+		depth_.fetch_sub(1, std::memory_order_relaxed);
+		free_->push(due);
+	}
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "avi_writer.h"
+#include "completion_queue.h"
+#include "frame_source.h"
+#include "latency.h"
+#include "yuv_convert.h"
+
+struct EncoderStats
+{
+	uint64_t encoded;
+	uint64_t dropped;   // no free staging buffer, every encoder behind
+	uint64_t failed;    // encode or write errors, or frames larger than configured
+	uint64_t filled;    // empty chunks keeping the timing over missing frames
+	uint64_t bytes;     // JPEG data written
+	unsigned int peakDepth; // most frames queued or encoding at once
+	LatencyHistogram::Summary wait;   // queued until an encoder took it
+	LatencyHistogram::Summary encode; // compression alone
+	LatencyHistogram::Summary total;  // encode() until written to the file
+};
+
+/*
+ * Compresses frames to one MJPEG AVI file per camera, prefix-camN.avi, on a
+ * set of encoder threads. As with RawRecorder, encode() only claims one of
+ * a fixed set of staging buffers, two per thread, and holds the frame. The
+ * encoder that takes it copies the frame in and hands it back before
+ * compressing, so a camera buffer is held for a copy, not a whole encode.
+ * A frame with no free staging buffer is dropped and counted. The staging
+ * buffers are allocated up front, padded for the largest camera.
+ *
+ * Whichever encoder is free takes the oldest queued frame, so frames of
+ * one camera are compressed concurrently and can finish out of order. They
+ * are written back in the order they came in, by whichever encoder finishes
+ * the next one due, and gaps in a camera's sequence numbers, dropped here
+ * or earlier, are filled with empty chunks to keep the file's timing.
+ */
+class MjpegEncoder
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+
+	/*
+	 * One file per entry of configs, which size the staging buffers. No
+	 * threads means all cores but the two the loop and renderer want.
+	 */
+	MjpegEncoder(std::string const &prefix, std::vector<libcamera::StreamConfiguration> const &configs,
+		     float fps, int quality, unsigned int threads);
+	~MjpegEncoder();
+
+	/* Called from an encoder thread once a frame has been copied. */
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+
+	void start();
+	/* Encodes and writes whatever is queued, then closes the files. */
+	void stop();
+
+	/*
+	 * Called from the event loop. Returns true if the frame is held, in
+	 * which case it comes back through the release handler and the mapping
+	 * must stay valid until then.
+	 */
+	bool encode(const Frame &frame, std::vector<libcamera::Span<uint8_t>> const &mapping);
+
+	unsigned int threads() const { return count_; }
+	EncoderStats stats() const;
+
+private:
+	struct Job
+	{
+		/* Planes padded to whole 16 pixel blocks, see copy(). */
+		std::vector<uint8_t> yuv;
+		/* The held frame, until copied. */
+		Frame frame;
+		YuvImage image;
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
+		unsigned int camera;
+		uint32_t sequence;
+		uint64_t ticket; // order within the camera
+		uint64_t queued;
+
+		/* Set by the encoder. */
+		std::vector<uint8_t> jpeg;
+		bool ok;
+	};
+
+	struct Output
+	{
+		std::unique_ptr<AviWriter> avi;
+		std::mutex lock; // held while writing, which keeps the order
+		uint64_t tickets; // handed out, event loop only
+		uint64_t next;    // ticket due to be written
+		uint32_t sequence; // of the last frame written
+		bool started;
+		std::map<uint64_t, unsigned int> done; // encoded jobs by ticket
+	};
+
+	void run();
+	void copy(Job &job);
+	void finish(unsigned int index);
+
+	int quality_;
+	unsigned int slots_;
+	std::vector<Job> jobs_;
+	std::vector<std::unique_ptr<Output>> outputs_;
+	std::unique_ptr<CompletionQueue<unsigned int>> free_;
+	std::unique_ptr<CompletionQueue<unsigned int>> queued_; // popped under lock_
+	ReleaseHandler release_;
+
+	unsigned int count_;
+	std::vector<std::thread> threads_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stopping_;
+
+	std::atomic<unsigned int> depth_;
+	std::atomic<unsigned int> peakDepth_;
+	std::atomic<uint64_t> encoded_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> failed_;
+	std::atomic<uint64_t> filled_;
+	std::atomic<uint64_t> bytes_;
+	LatencyHistogram wait_;
+	LatencyHistogram encode_;
+	LatencyHistogram total_;
+};
@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * motion_detector.cpp - Tile based motion detection on the luma plane
+ */
+
+#include "motion_detector.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Frames with moving tiles needed to start, and quiet frames to stop. */
+static constexpr unsigned int kStartFrames = 3;
+static constexpr unsigned int kStopFrames = 30;
+/* Longest gap between processed frames under load. */
+static constexpr unsigned int kMaxInterval = 8;
+
+/* Sum of absolute differences of one 16 pixel tile row. */
+static inline unsigned int tileRowSad(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+	__m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)),
+				   _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+	return _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+#elif defined(__aarch64__)
+	return vaddlvq_u8(vabdq_u8(vld1q_u8(a), vld1q_u8(b)));
+#else
+	unsigned int sum = 0;
+	for (unsigned int i = 0; i < MotionDetector::kTile; i++)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sum;
+#endif
+}
+
+MotionDetector::MotionDetector(unsigned int cameras, float fps, unsigned int scale, unsigned int threshold)
+	: scale_(std::max(1u, scale)), threshold_(threshold), stopping_(false), interval_(1), averageNs_(0),
+	  processed_(0), skipped_(0)
+{
+	/* Keep the worker busy for at most half of each frame period. */
+	budgetNs_ = fps > 0 ? 500000000 / fps : 16000000;
+
+	Camera camera = {};
+	camera.active = false;
+	cameras_.resize(cameras, camera);
+}
+
+MotionDetector::~MotionDetector()
+{
+	stop();
+}
+
+void MotionDetector::start()
+{
+	stopping_ = false;
+	thread_ = std::thread(&MotionDetector::run, this);
+}
+
+void MotionDetector::stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+
+	for (Camera &camera : cameras_) {
+		if (camera.pending)
+			release_(camera.frame);
+		camera.pending = false;
+	}
+}
+
+bool MotionDetector::submit(const Frame &frame, const YuvImage &image)
+{
+	if (frame.source >= cameras_.size() || !image.y)
+		return false;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		Camera &camera = cameras_[frame.source];
+		if (camera.pending || camera.countdown) {
+			if (camera.countdown)
+				camera.countdown--;
+			skipped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		camera.pending = true;
+		camera.frame = frame;
+		camera.image = image;
+		camera.countdown = interval_.load(std::memory_order_relaxed) - 1;
+	}
+	cond_.notify_one();
+	return true;
+}
+
+std::vector<uint8_t> MotionDetector::tiles(unsigned int camera, unsigned int &columns, unsigned int &rows)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	columns = cameras_[camera].columns;
+	rows = cameras_[camera].rows;
+	return cameras_[camera].moving;
+}
+
+MotionStats MotionDetector::stats(bool reset)
+{
+	MotionStats stats = { processed_.load(), skipped_.load(), cost_.summary() };
+	if (reset) {
+		processed_ = 0;
+		skipped_ = 0;
+		cost_.reset();
+	}
+	return stats;
+}
+
+void MotionDetector::run()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	while (true) {
+		cond_.wait(locker, [this]() {
+			if (stopping_)
+				return true;
+			for (const Camera &camera : cameras_) {
+				if (camera.pending)
+					return true;
+			}
+			return false;
+		});
+		if (stopping_)
+			break;
+
+		for (unsigned int i = 0; i < cameras_.size(); i++) {
+			if (!cameras_[i].pending)
+				continue;
+
+			/* pending keeps submit() off this camera's slot meanwhile. */
+			locker.unlock();
+			uint64_t start = latencyNow();
+			process(cameras_[i], i);
+			uint64_t cost = latencyNow() - start;
+			locker.lock();
+			cameras_[i].pending = false;
+
+			cost_.record(cost / 1000);
+			processed_.fetch_add(1, std::memory_order_relaxed);
+
+			/*
+			 * Spread the work over more frames when every camera at full
+			 * rate wouldn't fit the budget, and back again once it would.
+			 */
+			averageNs_ = averageNs_ ? (averageNs_ * 7 + cost) / 8 : cost;
+			uint64_t load = averageNs_ * cameras_.size();
+			unsigned int interval = std::min<uint64_t>(kMaxInterval, load / budgetNs_ + 1);
+			interval_.store(interval, std::memory_order_relaxed);
+		}
+	}
+}
+
+void MotionDetector::process(Camera &camera, unsigned int index)
+{
+	const YuvImage &image = camera.image;
+	unsigned int columns = image.width / scale_ / kTile;
+	unsigned int rows = image.height / scale_ / kTile;
+	unsigned int width = columns * kTile;
+	unsigned int height = rows * kTile;
+
+	if (width != camera.width || height != camera.height) {
+		camera.width = width;
+		camera.height = height;
+		camera.current.assign(width * height, 0);
+		camera.previous.assign(width * height, 0);
+		std::unique_lock<std::mutex> locker(lock_);
+		camera.columns = columns;
+		camera.rows = rows;
+		camera.moving.assign(columns * rows, 0);
+		camera.next.assign(columns * rows, 0);
+		camera.valid = false;
+	}
+
+	camera.previous.swap(camera.current);
+	for (unsigned int y = 0; y < height; y++) {
+		const uint8_t *src = image.y + (size_t)y * scale_ * image.stride;
+		uint8_t *dst = &camera.current[(size_t)y * width];
+		for (unsigned int x = 0; x < width; x++)
+			dst[x] = src[x * scale_];
+	}
+
+	/* The rest only reads the small copy, the buffer can go back now. */
+	release_(camera.frame);
+
+	if (!camera.valid) {
+		camera.valid = true;
+		return;
+	}
+
+	std::vector<unsigned int> &sums = sums_;
+	sums.resize(columns);
+	unsigned int limit = threshold_ * kTile * kTile;
+	unsigned int moving = 0;
+	for (unsigned int ty = 0; ty < rows; ty++) {
+		std::fill(sums.begin(), sums.end(), 0);
+		for (unsigned int y = ty * kTile; y < (ty + 1) * kTile; y++) {
+			const uint8_t *a = &camera.current[(size_t)y * width];
+			const uint8_t *b = &camera.previous[(size_t)y * width];
+			for (unsigned int tx = 0; tx < columns; tx++)
+				sums[tx] += tileRowSad(a + tx * kTile, b + tx * kTile);
+		}
+		for (unsigned int tx = 0; tx < columns; tx++) {
+			bool tile = sums[tx] > limit;
+			camera.next[ty * columns + tx] = tile;
+			moving += tile;
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		camera.moving.swap(camera.next);
+	}
+
+	/* Hysteresis: a state only flips after a run of frames against it. */
+	bool against = camera.active ? !moving : moving;
+	camera.streak = against ? camera.streak + 1 : 0;
+	if (camera.streak >= (camera.active ? kStopFrames : kStartFrames)) {
+		camera.active = !camera.active;
+		camera.streak = 0;
+		if (trigger_)
+			trigger_(index, camera.active, moving);
+	}
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+#include "latency.h"
+#include "yuv_convert.h"
+
+struct MotionStats
+{
+	uint64_t processed; // frames compared with their predecessor
+	uint64_t skipped;   // frames passed over to keep within the budget
+	LatencyHistogram::Summary cost; // per processed frame
+};
+
+/*
+ * Per-camera motion detection on the luma plane. Each processed frame is
+ * point sampled down by the scale factor straight from its mapped buffer,
+ * which then goes back through the release handler, and compared with the
+ * last one in 16x16 tiles of the small image. A tile moves when its mean
+ * absolute difference passes the threshold; a camera's motion starts after
+ * a few frames in a row with moving tiles and stops after a longer quiet
+ * spell, and each change is reported through the trigger handler from the
+ * worker thread.
+ *
+ * Everything runs on one worker. submit() never waits: a camera's frame is
+ * passed over while its last one is still queued, and while the average
+ * cost would take the worker past its share of a frame period, only every
+ * n-th frame is processed.
+ */
+class MotionDetector
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+	using TriggerHandler = std::function<void(unsigned int camera, bool moving, unsigned int tiles)>;
+
+	static constexpr unsigned int kTile = 16;
+
+	MotionDetector(unsigned int cameras, float fps, unsigned int scale, unsigned int threshold);
+	~MotionDetector();
+
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+	void onTrigger(const TriggerHandler &handler) { trigger_ = handler; }
+
+	void start();
+	void stop();
+
+	/* Called from the event loop. Returns false if the frame was passed over. */
+	bool submit(const Frame &frame, const YuvImage &image);
+
+	/* Moving tiles of a camera's last processed frame, row by row. */
+	std::vector<uint8_t> tiles(unsigned int camera, unsigned int &columns, unsigned int &rows);
+
+	MotionStats stats(bool reset = false);
+
+private:
+	struct Camera
+	{
+		/* Handed over by submit(), under lock_. */
+		bool pending;
+		Frame frame;
+		YuvImage image;
+		unsigned int countdown; // frames to pass over before the next one
+
+		/* Worker only, apart from tiles(). */
+		std::vector<uint8_t> previous;
+		std::vector<uint8_t> current;
+		std::vector<uint8_t> moving;
+		std::vector<uint8_t> next; // worker's copy of moving while it's filled in
+		unsigned int width, height;
+		unsigned int columns, rows;
+		bool valid;
+		bool active;
+		unsigned int streak; // frames in a row against the current state
+	};
+
+	void run();
+	void process(Camera &camera, unsigned int index);
+
+	unsigned int scale_;
+	unsigned int threshold_;
+	uint64_t budgetNs_;
+
+	std::vector<Camera> cameras_;
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stopping_;
+
+	/* Process one frame in interval_, adjusted from the average cost. */
+	std::atomic<unsigned int> interval_;
+	uint64_t averageNs_;
+	std::vector<unsigned int> sums_;
+
+	ReleaseHandler release_;
+	TriggerHandler trigger_;
+
+	std::atomic<uint64_t> processed_;
+	std::atomic<uint64_t> skipped_;
+	LatencyHistogram cost_;
+};
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * pretrigger_ring.cpp - Keep the seconds before an event in mapped files
+ */
+
+#include "pretrigger_ring.h"
+#include "raw_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+using namespace libcamera;
+
+static constexpr size_t kPage = 4096;
+
+static size_t pageAlign(size_t size)
+{
+	return (size + kPage - 1) & ~(kPage - 1);
+}
+
+PretriggerRing::PretriggerRing(std::string const &prefix, std::vector<StreamConfiguration> const &configs,
+			       float seconds, float fps)
+	: prefix_(prefix), seconds_(seconds), rings_(configs.size(), Ring{ -1, nullptr, 0, nullptr, nullptr, nullptr }),
+	  flushing_(false), missed_(0), triggers_(0)
+{
+	/* One spare slot so a full window survives jitter in the frame rate. */
+	slots_ = std::max(2u, (unsigned int)std::ceil(seconds * fps) + 1);
+
+	for (unsigned int camera = 0; camera < configs.size(); camera++)
+		create(camera, pageAlign(sizeof(RawFrameHeader) + rawPayloadSize(configs[camera])));
+}
+
+PretriggerRing::~PretriggerRing()
+{
+	if (flusher_.joinable())
+		flusher_.join();
+
+	for (Ring &ring : rings_) {
+		if (ring.map)
+			munmap(ring.map, ring.mapSize);
+		if (ring.fd >= 0)
+			close(ring.fd);
+	}
+}
+
+void PretriggerRing::create(unsigned int camera, size_t slotSize)
+{
+	Ring &ring = rings_[camera];
+	std::string path = prefix_ + "-cam" + std::to_string(camera) + ".ring";
+	size_t indexSize = pageAlign(sizeof(RingIndex) + slots_ * sizeof(uint64_t));
+	ring.mapSize = indexSize + slots_ * slotSize;
+
+	ring.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (ring.fd < 0)
+		throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+
+	/* Reserve the blocks now so a full disk can't SIGBUS us mid-copy. */
+	int ret = posix_fallocate(ring.fd, 0, ring.mapSize);
+	if (ret)
+		throw std::runtime_error("failed to allocate " + path + ": " + strerror(ret));
+
+	void *map = mmap(NULL, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, 0);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("failed to map " + path + ": " + strerror(errno));
+
+	ring.map = static_cast<uint8_t *>(map);
+	ring.index = reinterpret_cast<RingIndex *>(ring.map);
+	ring.timestamps = reinterpret_cast<uint64_t *>(ring.map + sizeof(RingIndex));
+	ring.slots = ring.map + indexSize;
+
+	memcpy(ring.index->magic, "SCRI", 4);
+	ring.index->slots = slots_;
+	ring.index->slotSize = slotSize;
+	ring.index->head = 0;
+	ring.index->count = 0;
+
+	std::cout << "Pre-trigger ring for camera " << camera << ": " << slots_ << " frames, "
+		  << ring.mapSize / 1000000 << "MB in " << path << std::endl;
+}
+
+void PretriggerRing::add(const Frame &frame, std::vector<Span<uint8_t>> const &mapping)
+{
+	if (frame.source >= rings_.size())
+		return;
+
+	if (flushing_.load(std::memory_order_acquire)) {
+		missed_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	StreamConfiguration const &config = *frame.config;
+	size_t payload = rawPayloadSize(config);
+	size_t available = 0;
+	for (Span<uint8_t> const &span : mapping)
+		available += span.size();
+	payload = std::min(payload, available);
+
+	Ring &ring = rings_[frame.source];
+	if (sizeof(RawFrameHeader) + payload > ring.index->slotSize)
+		return;
+
+	unsigned int slot = ring.index->head;
+	uint8_t *dst = ring.slots + (size_t)slot * ring.index->slotSize;
+
+	RawFrameHeader *header = reinterpret_cast<RawFrameHeader *>(dst);
+	memcpy(header->magic, "SCRF", 4);
+	header->headerSize = sizeof(RawFrameHeader);
+	header->recordSize = ring.index->slotSize;
+	header->payloadSize = payload;
+	header->camera = frame.source;
+	header->sequence = frame.sequence;
+	header->timestamp = frame.timestamp;
+	header->width = config.size.width;
+	header->height = config.size.height;
+	header->stride = config.stride;
+	header->reserved = 0;
+
+	dst += sizeof(RawFrameHeader);
+	size_t remaining = payload;
+	for (Span<uint8_t> const &span : mapping) {
+		size_t length = std::min(remaining, span.size());
+		memcpy(dst, span.data(), length);
+		dst += length;
+		remaining -= length;
+	}
+
+	ring.timestamps[slot] = frame.timestamp;
+	ring.index->head = (slot + 1) % ring.index->slots;
+	ring.index->count++;
+}
+
+bool PretriggerRing::trigger()
+{
+	if (flushing_.load(std::memory_order_acquire))
+		return false;
+
+	if (flusher_.joinable())
+		flusher_.join();
+
+	flushing_.store(true, std::memory_order_release);
+	flusher_ = std::thread(&PretriggerRing::flush, this, triggers_++);
+	return true;
+}
+
+void PretriggerRing::flush(unsigned int trigger)
+{
+	for (unsigned int camera = 0; camera < rings_.size(); camera++) {
+		Ring &ring = rings_[camera];
+		if (!ring.map || !ring.index->count)
+			continue;
+
+		unsigned int slots = ring.index->slots;
+		unsigned int filled = std::min<uint64_t>(ring.index->count, slots);
+		unsigned int newest = (ring.index->head + slots - 1) % slots;
+		uint64_t window = seconds_ * 1e9;
+		uint64_t since = ring.timestamps[newest] > window ? ring.timestamps[newest] - window : 0;
+
+		std::string path = prefix_ + "-cam" + std::to_string(camera) + "-trigger" +
+				   std::to_string(trigger) + ".raw";
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			std::cerr << "failed to open " << path << ": " << strerror(errno) << std::endl;
+			continue;
+		}
+
+		unsigned int written = 0;
+		for (unsigned int i = 0; i < filled; i++) {
+			unsigned int slot = (ring.index->head + slots - filled + i) % slots;
+			if (ring.timestamps[slot] < since)
+				continue;
+
+			const uint8_t *record = ring.slots + (size_t)slot * ring.index->slotSize;
+			size_t done = 0;
+			while (done < ring.index->slotSize) {
+				ssize_t ret = write(fd, record + done, ring.index->slotSize - done);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0)
+					break;
+				done += ret;
+			}
+			if (done < ring.index->slotSize) {
+				std::cerr << "failed to write " << path << ": " << strerror(errno) << std::endl;
+				break;
+			}
+			written++;
+		}
+
+		fsync(fd);
+		close(fd);
+		std::cout << "Saved " << written << " pre-trigger frames to " << path << std::endl;
+	}
+
+	flushing_.store(false, std::memory_order_release);
+}
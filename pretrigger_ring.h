@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+
+/*
+ * Keeps the last few seconds of every camera in a ring of fixed-size slots
+ * in a memory-mapped file, <prefix>-camN.ring, so that the frames leading
+ * up to an event can be saved once it has happened. The file starts with an
+ * index page (slot count, slot size, next slot and the sensor timestamp of
+ * every slot), followed by the slots, each holding a RawFrameHeader and the
+ * frame as in a RawRecorder file.
+ *
+ * Each camera gets a ring whose slots fit its own stream, so a small
+ * preview camera doesn't pay for a large one. The constructor creates,
+ * allocates and maps them all, so add() is a copy into the mapping and
+ * nothing else. trigger() freezes
+ * every ring and writes the frames of the last window, oldest first, to
+ * <prefix>-camN-triggerK.raw from a thread of its own. Frames that arrive
+ * while the rings are frozen are not kept.
+ */
+class PretriggerRing
+{
+public:
+	PretriggerRing(std::string const &prefix, std::vector<libcamera::StreamConfiguration> const &configs,
+		       float seconds, float fps);
+	~PretriggerRing();
+
+	/* Called from the event loop; the mapping is only read before returning. */
+	void add(const Frame &frame, std::vector<libcamera::Span<uint8_t>> const &mapping);
+
+	/* Freeze and flush the rings. Ignored while a flush is still running. */
+	bool trigger();
+
+	/* Frames not kept because a flush was running. */
+	uint64_t missed() const { return missed_.load(std::memory_order_relaxed); }
+
+private:
+	struct RingIndex
+	{
+		char magic[4]; // "SCRI"
+		uint32_t slots;
+		uint32_t slotSize;
+		uint32_t head;  // slot the next frame goes to
+		uint64_t count; // frames ever added
+		// followed by uint64_t timestamps[slots]
+	};
+
+	struct Ring
+	{
+		int fd;
+		uint8_t *map;
+		size_t mapSize;
+		RingIndex *index;
+		uint64_t *timestamps;
+		uint8_t *slots;
+	};
+
+	void create(unsigned int camera, size_t slotSize);
+	void flush(unsigned int trigger);
+
+	std::string prefix_;
+	float seconds_;
+	unsigned int slots_;
+	std::vector<Ring> rings_;
+
+	std::thread flusher_;
+	std::atomic<bool> flushing_;
+	std::atomic<uint64_t> missed_;
+	unsigned int triggers_;
+};
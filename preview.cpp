@@ -1,4 +1,6 @@
 #include "preview.h"
+#include "latency.h"
+#include "trace.h"
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -17,11 +19,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <unistd.h>
 
 #define ERRSTR strerror(errno)
@@ -39,6 +48,97 @@ int y;
 int width;
 int height;
 
+// Headless only: the last frame is read back here when a readback file is
+// set, and written out by cleanup().
+static std::string readback_path;
+static std::vector<uint8_t> readback_pixels;
+
+static PreviewLayout preview_layout = PreviewLayout::Grid;
+
+static PresentTiming present_timing = {};
+
+// Atomic page flips complete on the event loop (handleDisplayEvents) while
+// the render thread waits for them before committing the next frame.
+static std::mutex flip_lock;
+static std::condition_variable flip_cond;
+static bool flip_pending = false;
+static uint64_t flip_time = 0;
+
+struct BufferImage
+{
+	libcamera::FrameBuffer *buffer; // null while the entry is unused
+	EGLImage image;
+	GLuint texture;
+};
+
+// The set of FrameBuffers is fixed for a given camera configuration, so each
+// dmabuf only needs importing once. Entries live until the camera is
+// reconfigured (invalidateBufferCache) or the preview is torn down.
+static std::vector<std::vector<BufferImage>> buffer_cache;
+static ImageCacheStats cache_stats = {};
+
+// Per-buffer caches are indexed by camera and then by the buffer's cookie,
+// which sources set to a dense index (see BufferPool), so finding an entry
+// is two array accesses.
+template<typename Entry>
+static Entry &cacheEntry(std::vector<std::vector<Entry>> &cache, int camera_num, libcamera::FrameBuffer *buffer)
+{
+	if (cache.size() <= (unsigned int)camera_num)
+		cache.resize(camera_num + 1);
+	std::vector<Entry> &entries = cache[camera_num];
+	unsigned int index = buffer->cookie();
+	if (entries.size() <= index)
+		entries.resize(index + 1, Entry{});
+	return entries[index];
+}
+
+// Camera buffers wrapped as DRM framebuffers for direct scanout, and the
+// overlay plane each camera is shown on.
+struct ScanoutFb
+{
+	libcamera::FrameBuffer *buffer; // null while the entry is unused
+	uint32_t id;
+	uint32_t handle;
+};
+struct ScanoutPlane
+{
+	uint32_t planeId;
+	PlaneProps props;
+	uint32_t fb;
+	uint32_t width, height;
+};
+static std::vector<std::vector<ScanoutFb>> scanout_cache;
+static std::vector<ScanoutPlane> scanout_planes;
+
+static void releaseImage(BufferImage &entry)
+{
+	if (!entry.buffer)
+		return;
+	glDeleteTextures(1, &entry.texture);
+	eglDestroyImageKHR(egl.display, entry.image);
+	entry = {};
+}
+
+static void releaseScanoutFb(ScanoutFb &fb)
+{
+	if (!fb.buffer)
+		return;
+	struct drm_gem_close close_handle = { fb.handle, 0 };
+	drmModeRmFB(drm.fd, fb.id);
+	drmIoctl(drm.fd, DRM_IOCTL_GEM_CLOSE, &close_handle);
+	fb = {};
+}
+
+// The CPU drawing target, set up on first use.
+static struct
+{
+	CpuTarget target;
+	uint32_t dumbHandle;
+	uint32_t fb;
+	size_t mapSize;
+	XImage *image;
+} cpu = {};
+
 static GLint compile_shader(GLenum target, const char *source)
 {
 	GLuint s = glCreateShader(target);
@@ -93,48 +193,111 @@ static GLint link_program(GLint vs, GLint fs)
 	return prog;
 }
 
-void gl_setup()
+// The compositor draws every view (the cameras, then the aux image) as one
+// quad each in a single draw call. Each vertex is a corner of its quad in
+// 0..1 and the view it belongs to; where the quad goes on screen comes from
+// the view's rectangle uniform, so changing the layout touches no geometry.
+static const char *compositor_vs =
+	"attribute vec3 corner;\n"
+	"uniform vec4 rects[%u];\n"
+	"varying vec2 texcoord;\n"
+	"varying float view;\n"
+	"\n"
+	"void main() {\n"
+	"  vec4 rect = rects[int(corner.z)];\n"
+	"  gl_Position = vec4(rect.xy + corner.xy * rect.zw, 0.0, 1.0);\n"
+	"  texcoord = vec2(corner.x, 1.0 - corner.y);\n"
+	"  view = corner.z;\n"
+	"}\n";
+
+// Samplers can't be indexed in GLSL ES 1.0, so the fragment shader picks one
+// with a branch per view. Views are whole quads, so branches never diverge
+// within one.
+static std::string compositorFragmentShader(unsigned int cameras, bool aux)
 {
-	float w_factor = 1920 / (float)1920;
-	float h_factor = 1080 / (float)1080;
-	float max_dimension = std::max(w_factor, h_factor);
-	w_factor /= max_dimension;
-	h_factor /= max_dimension;
-	char vs[256];
-	snprintf(vs, sizeof(vs),
-			 "attribute vec4 pos;\n"
+	std::string fs = "#extension GL_OES_EGL_image_external : enable\n"
+			 "precision mediump float;\n"
 			 "varying vec2 texcoord;\n"
-			 "\n"
-			 "void main() {\n"
-			 "  gl_Position = pos;\n"
-			 "  texcoord.x = pos.x / %f + 0.5;\n"
-			 "  texcoord.y = 0.5 - pos.y / %f;\n"
-			 "}\n",
-			 2.0 * w_factor, 2.0 * h_factor);
-	vs[sizeof(vs) - 1] = 0;
+			 "varying float view;\n";
+	for (unsigned int i = 0; i < cameras; i++)
+		fs += "uniform samplerExternalOES camera" + std::to_string(i) + ";\n";
+	if (aux)
+		fs += "uniform sampler2D aux;\n";
+
+	fs += "void main() {\n";
+	for (unsigned int i = 0; i < cameras; i++)
+	{
+		fs += i ? "  else if" : "  if";
+		fs += " (view < " + std::to_string(i) + ".5)\n"
+		      "    gl_FragColor = texture2D(camera" + std::to_string(i) + ", texcoord);\n";
+	}
+	if (aux)
+		fs += std::string(cameras ? "  else\n" : "") + "    gl_FragColor = vec4(texture2D(aux, texcoord).rrr, 1.0);\n";
+	fs += "}\n";
+	return fs;
+}
+
+// (Re)build the compositor for this many views. Texture unit i holds view i.
+static void setupCompositor(unsigned int cameras, bool aux)
+{
+	if (egl.compositor.program && egl.compositor.cameras == cameras && egl.compositor.aux == aux)
+		return;
+	if (egl.compositor.program)
+		glDeleteProgram(egl.compositor.program);
+
+	unsigned int views = cameras + (aux ? 1 : 0);
+	GLint units = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+	if (views > (unsigned int)units)
+		throw std::runtime_error("too many views to compose: " + std::to_string(views));
+
+	char vs[512];
+	snprintf(vs, sizeof(vs), compositor_vs, std::max(1u, views));
 	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs);
-	const char *fs = "#extension GL_OES_EGL_image_external : enable\n"
-					 "precision mediump float;\n"
-					 "uniform samplerExternalOES s;\n"
-					 "varying vec2 texcoord;\n"
-					 "void main() {\n"
-					 "  gl_FragColor = texture2D(s, texcoord);\n"
-					 "}\n";
-	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
-	GLint prog = link_program(vs_s, fs_s);
+	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, compositorFragmentShader(cameras, aux).c_str());
+	GLuint prog = link_program(vs_s, fs_s);
+	glDeleteShader(vs_s);
+	glDeleteShader(fs_s);
 
 	glUseProgram(prog);
+	for (unsigned int i = 0; i < cameras; i++)
+		glUniform1i(glGetUniformLocation(prog, ("camera" + std::to_string(i)).c_str()), i);
+	if (aux)
+		glUniform1i(glGetUniformLocation(prog, "aux"), cameras);
+
+	egl.compositor.program = prog;
+	egl.compositor.rects = glGetUniformLocation(prog, "rects");
+	egl.compositor.cameras = cameras;
+	egl.compositor.aux = aux;
+
+	// Two triangles per view.
+	static const float corners[] = { 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1 };
+	egl.compositor.vertices.clear();
+	for (unsigned int view = 0; view < views; view++)
+	{
+		for (unsigned int i = 0; i < 6; i++)
+		{
+			egl.compositor.vertices.push_back(corners[i * 2]);
+			egl.compositor.vertices.push_back(corners[i * 2 + 1]);
+			egl.compositor.vertices.push_back(view);
+		}
+	}
+	GLint corner = glGetAttribLocation(prog, "corner");
+	glVertexAttribPointer(corner, 3, GL_FLOAT, GL_FALSE, 0, egl.compositor.vertices.data());
+	glEnableVertexAttribArray(corner);
+}
 
-	static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
-	glEnableVertexAttribArray(0);
-	glGenTextures(1, &egl.FramebufferName);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glGenTextures(1, &egl.FramebufferName2);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	
+void gl_setup()
+{
+	// The compositor itself waits for the first frame, which tells how
+	// many views there are.
+	egl.compositor = {};
+	egl.auxTexture = 0;
+
+	const char *extensions = eglQueryString(egl.display, EGL_EXTENSIONS);
+	egl.fenceSync = extensions && strstr(extensions, "EGL_KHR_fence_sync");
+	if (!egl.fenceSync)
+		printf("No EGL_KHR_fence_sync, waiting for the GPU after every frame\n");
 }
 
 static drmModeConnector *getConnector(drmModeRes *resources)
@@ -186,10 +349,13 @@ static int matchConfigToVisual(EGLDisplay display, EGLint visualId, EGLConfig *c
     return -1;
 }
 
-void findPlane()
+// Returns the first plane on our CRTC that can show the given format and
+// isn't in exclude, or 0 if there is none.
+static uint32_t findPlane(uint32_t format, std::vector<uint32_t> const &exclude)
 {
 	drmModePlaneResPtr planes;
 	drmModePlanePtr plane;
+	uint32_t found = 0;
 	unsigned int i;
 	unsigned int j;
 	planes = drmModeGetPlaneResources(drm.fd);
@@ -198,13 +364,14 @@ void findPlane()
 
 	try
 	{
-		for (i = 0; i < planes->count_planes; ++i)
+		for (i = 0; i < planes->count_planes && !found; ++i)
 		{
 			plane = drmModeGetPlane(drm.fd, planes->planes[i]);
-			if (!planes)
+			if (!plane)
 				throw std::runtime_error("drmModeGetPlane failed: " + std::string(ERRSTR));
 
-			if (!(plane->possible_crtcs & (1 << drm.crtcIdx)))
+			if (!(plane->possible_crtcs & (1 << drm.crtcIdx)) ||
+			    std::find(exclude.begin(), exclude.end(), plane->plane_id) != exclude.end())
 			{
 				drmModeFreePlane(plane);
 				continue;
@@ -212,21 +379,15 @@ void findPlane()
 
 			for (j = 0; j < plane->count_formats; ++j)
 			{
-				if (plane->formats[j] == GBM_FORMAT_XRGB8888)
+				if (plane->formats[j] == format)
 				{
 					break;
 				}
 			}
 
-			if (j == plane->count_formats)
-			{
-				drmModeFreePlane(plane);
-				continue;
-			}
-		
-			drm.planeId = plane->plane_id;
+			if (j < plane->count_formats)
+				found = plane->plane_id;
 			drmModeFreePlane(plane);
-			break;
 		}
 	}
 	catch (std::exception const &e)
@@ -235,6 +396,57 @@ void findPlane()
 		throw;
 	}
 	drmModeFreePlaneResources(planes);
+	return found;
+}
+
+static uint32_t getPropertyId(uint32_t object, uint32_t type, const char *name)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm.fd, object, type);
+	if (!props)
+		return 0;
+
+	uint32_t id = 0;
+	for (uint32_t i = 0; i < props->count_props && !id; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(drm.fd, props->props[i]);
+		if (prop && !strcmp(prop->name, name))
+			id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+static bool getPlaneProps(uint32_t plane, PlaneProps &p)
+{
+	p.fbId = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	p.crtcId = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	p.srcX = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "SRC_X");
+	p.srcY = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+	p.srcW = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "SRC_W");
+	p.srcH = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "SRC_H");
+	p.crtcX = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+	p.crtcY = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+	p.crtcW = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+	p.crtcH = getPropertyId(plane, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+
+	return p.fbId && p.crtcId && p.srcX && p.srcY && p.srcW && p.srcH &&
+	       p.crtcX && p.crtcY && p.crtcW && p.crtcH;
+}
+
+// Use atomic commits when the driver allows it, otherwise stay on the
+// legacy (blocking) SetPlane path.
+static void setupAtomic()
+{
+	if (drmSetClientCap(drm.fd, DRM_CLIENT_CAP_ATOMIC, 1))
+	{
+		printf("DRM atomic modesetting not available, using legacy SetPlane\n");
+		return;
+	}
+
+	drm.atomic = getPlaneProps(drm.planeId, drm.planeProps);
+	if (!drm.atomic)
+		printf("DRM plane is missing atomic properties, using legacy SetPlane\n");
 }
 
 void setupX11(char const *name, int x, int y, int width, int height)
@@ -388,8 +600,77 @@ void setupDRM()
 	free(egl.configs);
 }
 
-int makeWindow(char const *name, int x, int y, int width, int height)
+// No window system at all: a surfaceless context (EGL_MESA_platform_surfaceless,
+// which Mesa's llvmpipe supports) or a pbuffer, drawing into an FBO that is
+// set up once the context is current on the render thread.
+void setupHeadless()
+{
+	const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+		egl.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	else
+		egl.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (egl.display == EGL_NO_DISPLAY)
+		throw std::runtime_error("eglGetDisplay() failed");
+
+	if (!eglInitialize(egl.display, &egl.major, &egl.minor))
+		throw std::runtime_error("failed to initialize\n");
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API))
+		throw std::runtime_error("failed to bind api EGL_OPENGL_ES_API\n");
+
+	if (!eglChooseConfig(egl.display, headless_conf_attribs, &egl.config, 1, &egl.num_configs) || egl.num_configs < 1)
+		throw std::runtime_error("couldn't get an EGL pbuffer config");
+
+	egl.context = eglCreateContext(egl.display, egl.config, EGL_NO_CONTEXT, ctx_attribs);
+	if (egl.context == EGL_NO_CONTEXT)
+		throw std::runtime_error("failed to create context\n");
+
+	const char *extensions = eglQueryString(egl.display, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_KHR_surfaceless_context"))
+		egl.surface = EGL_NO_SURFACE;
+	else
+	{
+		static const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		egl.surface = eglCreatePbufferSurface(egl.display, egl.config, pbuffer_attribs);
+		if (egl.surface == EGL_NO_SURFACE)
+			throw std::runtime_error("failed to create pbuffer surface\n");
+	}
+
+	printf("Headless EGL %d.%d (%s)\n", egl.major, egl.minor,
+	       egl.surface == EGL_NO_SURFACE ? "surfaceless" : "pbuffer");
+}
+
+static void setupOffscreen()
+{
+	glGenTextures(1, &egl.offscreenTexture);
+	glBindTexture(GL_TEXTURE_2D, egl.offscreenTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	glGenFramebuffers(1, &egl.offscreenFbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, egl.offscreenFbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, egl.offscreenTexture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		throw std::runtime_error("offscreen framebuffer incomplete");
+}
+
+void setReadback(std::string const &path)
 {
+	readback_path = path;
+}
+
+int makeWindow(char const *name, int x, int y, int width, int height, bool headless)
+{
+	::width = width;
+	::height = height;
+
+	if (headless)
+	{
+		display_mode = "HEADLESS";
+		setupHeadless();
+		return 0;
+	}
+
 	//Open DRM device first since its very easy to tell if we can use it or if X11 is the master.
 	//We have to try card0 and card1 to see which is valid since it can vary depending on bootup
 	drm.fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
@@ -401,6 +682,7 @@ int makeWindow(char const *name, int x, int y, int width, int height)
 	}
 
 	if (!drmIsMaster(drm.fd)){ //X11 is master, so render to X11
+		XInitThreads(); // we draw from the render thread
 		X11.display = XOpenDisplay(NULL);
 		if (!X11.display)
 			printf("Couldn't open X display");
@@ -454,7 +736,10 @@ int makeWindow(char const *name, int x, int y, int width, int height)
 			throw std::runtime_error("drm: CRTC " + std::to_string(drm.crtcId) + " not found");
 		}
 
-		findPlane();
+		// Universal planes so that primary planes show up in findPlane().
+		drmSetClientCap(drm.fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		drm.planeId = findPlane(GBM_FORMAT_XRGB8888, {});
+		setupAtomic();
 		
 		drmModeFreeEncoder(drm.encoder);
 		drmModeFreeConnector(drm.connector);
@@ -497,125 +782,759 @@ int makeWindow(char const *name, int x, int y, int width, int height)
 
 void makeBuffer(int fd, libcamera::StreamConfiguration const &info, libcamera::FrameBuffer *buffer, int camera_num)
 {
+	TRACE_SCOPE("makeBuffer");
 	if (first_time_)
 	{
 		// This stuff has to be delayed until we know we're in the thread doing the display.
 		if (!eglMakeCurrent(egl.display, egl.surface, egl.surface, egl.context))
 			throw std::runtime_error("eglMakeCurrent failed");
 		gl_setup();
+		if (display_mode == "HEADLESS")
+			setupOffscreen();
 		first_time_ = false;
 	}
 
-	EGLint attribs[] = {
-		EGL_WIDTH, static_cast<EGLint>(info.size.width),
-		EGL_HEIGHT, static_cast<EGLint>(info.size.height),
-		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_YUV420,
-		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
-		EGL_DMA_BUF_PLANE1_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE1_OFFSET_EXT, static_cast<EGLint>(info.stride * info.size.height),
-		EGL_DMA_BUF_PLANE1_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
-		EGL_DMA_BUF_PLANE2_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE2_OFFSET_EXT, static_cast<EGLint>(info.stride * info.size.height + (info.stride / 2) * (info.size.height / 2)),
-		EGL_DMA_BUF_PLANE2_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
-		EGL_YUV_COLOR_SPACE_HINT_EXT, EGL_ITU_REC601_EXT, //maybe 701?
-		EGL_SAMPLE_RANGE_HINT_EXT, EGL_YUV_NARROW_RANGE_EXT, //maybe full?
-		EGL_NONE
-	};
-
-	EGLImage image = eglCreateImageKHR(egl.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
-	if (!image)
-		throw std::runtime_error("failed to import fd " + std::to_string(fd));
-
-	if (camera_num == 0)
-		glBindTexture(GL_TEXTURE_EXTERNAL_OES, egl.FramebufferName);
-	else if (camera_num == 1)
-		glBindTexture(GL_TEXTURE_EXTERNAL_OES, egl.FramebufferName2);
-	
-	//glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	//glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+	BufferImage &entry = cacheEntry(buffer_cache, camera_num, buffer);
+	if (entry.buffer == buffer)
+		cache_stats.hits++;
+	else
+	{
+		releaseImage(entry);
+		EGLint attribs[] = {
+			EGL_WIDTH, static_cast<EGLint>(info.size.width),
+			EGL_HEIGHT, static_cast<EGLint>(info.size.height),
+			EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_YUV420,
+			EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
+			EGL_DMA_BUF_PLANE1_FD_EXT, fd,
+			EGL_DMA_BUF_PLANE1_OFFSET_EXT, static_cast<EGLint>(info.stride * info.size.height),
+			EGL_DMA_BUF_PLANE1_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
+			EGL_DMA_BUF_PLANE2_FD_EXT, fd,
+			EGL_DMA_BUF_PLANE2_OFFSET_EXT, static_cast<EGLint>(info.stride * info.size.height + (info.stride / 2) * (info.size.height / 2)),
+			EGL_DMA_BUF_PLANE2_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
+			EGL_YUV_COLOR_SPACE_HINT_EXT, EGL_ITU_REC601_EXT, //maybe 701?
+			EGL_SAMPLE_RANGE_HINT_EXT, EGL_YUV_NARROW_RANGE_EXT, //maybe full?
+			EGL_NONE
+		};
+
+		EGLImage image = eglCreateImageKHR(egl.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+		if (!image)
+			throw std::runtime_error("failed to import fd " + std::to_string(fd));
+
+		entry = { buffer, image, 0 };
+		glGenTextures(1, &entry.texture);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, entry.texture);
+		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+
+		cache_stats.misses++;
+	}
 
-	eglDestroyImageKHR(egl.display, image);
+	// The texture stays attached to the dmabuf, so all that changes per frame
+	// is which one gets drawn for this camera.
+	if (egl.cameraTextures.size() <= (unsigned int)camera_num)
+	{
+		egl.cameraTextures.resize(camera_num + 1, 0);
+		egl.cameraAspects.resize(camera_num + 1, 1.0f);
+	}
+	egl.cameraTextures[camera_num] = entry.texture;
+	egl.cameraAspects[camera_num] = info.size.width / (float)info.size.height;
+}
+
+void invalidateBufferCache(int camera_num)
+{
+	for (unsigned int i = 0; i < buffer_cache.size(); i++)
+	{
+		if (camera_num >= 0 && i != (unsigned int)camera_num)
+			continue;
+		for (BufferImage &entry : buffer_cache[i])
+			releaseImage(entry);
+		buffer_cache[i].clear();
+	}
+
+	for (unsigned int i = 0; i < scanout_cache.size(); i++)
+	{
+		if (camera_num >= 0 && i != (unsigned int)camera_num)
+			continue;
+		for (ScanoutFb &fb : scanout_cache[i])
+			releaseScanoutFb(fb);
+		scanout_cache[i].clear();
+	}
+}
+
+ImageCacheStats imageCacheStats()
+{
+	return cache_stats;
+}
+
+struct DrmFb
+{
+	int fd;
+	uint32_t id;
+};
+
+static void destroyFb(struct gbm_bo *bo, void *data)
+{
+	DrmFb *fb = static_cast<DrmFb *>(data);
+	drmModeRmFB(fb->fd, fb->id);
+	delete fb;
+}
+
+// GBM surfaces cycle through a small fixed set of BOs, so the framebuffer is
+// created the first time each one is seen and kept in its user data until
+// the surface destroys it.
+static uint32_t bufferObjectFb(struct gbm_bo *bo)
+{
+	DrmFb *fb = static_cast<DrmFb *>(gbm_bo_get_user_data(bo));
+	if (fb)
+		return fb->id;
+
+	uint32_t handles[4] = { gbm_bo_get_handle(bo).u32 };
+	uint32_t pitches[4] = { gbm_bo_get_stride(bo) };
+	uint32_t offsets[4] = { 0 };
+
+	fb = new DrmFb{ drm.fd, 0 };
+	if (drmModeAddFB2(drm.fd, gbm_bo_get_width(bo), gbm_bo_get_height(bo), GBM_FORMAT_XRGB8888,
+			  handles, pitches, offsets, &fb->id, 0))
+	{
+		delete fb;
+		throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
+	}
+	gbm_bo_set_user_data(bo, fb, destroyFb);
+	return fb->id;
+}
+
+static void pageFlipHandler(int fd, unsigned int sequence, unsigned int sec, unsigned int usec, void *data)
+{
+	std::unique_lock<std::mutex> locker(flip_lock);
+	flip_pending = false;
+	// DRM event timestamps are CLOCK_MONOTONIC, the same as latencyNow().
+	flip_time = sec * 1000000000ULL + usec * 1000ULL;
+	flip_cond.notify_one();
+}
+
+int displayEventFd()
+{
+	return display_mode == "DRM" && drm.atomic ? drm.fd : -1;
+}
+
+void handleDisplayEvents()
+{
+	drmEventContext context = {};
+	context.version = 2;
+	context.page_flip_handler = pageFlipHandler;
+	drmHandleEvent(drm.fd, &context);
+}
+
+// Only one atomic commit may be outstanding. The flip normally completes
+// within a refresh; the timeout only matters once the event loop has stopped
+// handling DRM events at shutdown.
+static uint64_t waitForFlip()
+{
+	std::unique_lock<std::mutex> locker(flip_lock);
+	if (!flip_cond.wait_for(locker, std::chrono::milliseconds(100), []() { return !flip_pending; }))
+	{
+		flip_pending = false;
+		return 0;
+	}
+	return flip_time;
+}
+
+// Show src_w x src_h of fb at the given CRTC rectangle, or disable the plane
+// when fb is 0.
+static void addPlane(drmModeAtomicReqPtr req, uint32_t plane, PlaneProps const &p, uint32_t fb,
+		     uint32_t src_w, uint32_t src_h, int x, int y, int w, int h)
+{
+	drmModeAtomicAddProperty(req, plane, p.fbId, fb);
+	drmModeAtomicAddProperty(req, plane, p.crtcId, fb ? drm.crtcId : 0);
+	drmModeAtomicAddProperty(req, plane, p.srcX, 0);
+	drmModeAtomicAddProperty(req, plane, p.srcY, 0);
+	drmModeAtomicAddProperty(req, plane, p.srcW, src_w << 16);
+	drmModeAtomicAddProperty(req, plane, p.srcH, src_h << 16);
+	drmModeAtomicAddProperty(req, plane, p.crtcX, x);
+	drmModeAtomicAddProperty(req, plane, p.crtcY, y);
+	drmModeAtomicAddProperty(req, plane, p.crtcW, w);
+	drmModeAtomicAddProperty(req, plane, p.crtcH, h);
+}
+
+static int commitWithFlipEvent(drmModeAtomicReqPtr req)
+{
+	int ret = drmModeAtomicCommit(drm.fd, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, NULL);
+	drmModeAtomicFree(req);
+	if (!ret)
+	{
+		std::unique_lock<std::mutex> locker(flip_lock);
+		flip_pending = true;
+	}
+	return ret;
+}
+
+static void atomicCommit(uint32_t fb)
+{
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	addPlane(req, drm.planeId, drm.planeProps, fb, drm.mode.hdisplay, drm.mode.vdisplay,
+		 0, 0, drm.mode.hdisplay, drm.mode.vdisplay);
+	if (commitWithFlipEvent(req))
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(ERRSTR));
 }
 
 void gbmSwapBuffers()
 {
+	TRACE_SCOPE("gbmSwapBuffers");
 	struct gbm_bo *bo = gbm_surface_lock_front_buffer(gbm.surface);
-	uint32_t handle = gbm_bo_get_handle(bo).u32;
-	uint32_t pitch = gbm_bo_get_stride(bo);
-	uint32_t fb;
-	
-	uint32_t offsets[4] =
-		{ 0, pitch * drm.mode.vdisplay, pitch * drm.mode.vdisplay + (pitch / 2) * (drm.mode.vdisplay / 2) };
-	uint32_t pitches[4] = { pitch, pitch / 2, pitch / 2 };
-	uint32_t handles[4] = { handle, handle, handle };
-	
-	//drmModeAddFB(drmfd_, drm_mode_.hdisplay, drm_mode_.vdisplay, 24, 32, pitch, handle, &fb);
-	drmModeAddFB2(drm.fd, drm.mode.hdisplay, drm.mode.vdisplay, GBM_FORMAT_XRGB8888,
-	              handles, pitches, offsets, &fb, 0);
-	//drmModeSetCrtc(drmfd_, crtc->crtc_id, fb, 0, 0, &conId_, 1, &drm_mode_);
-	
-	if (drmModeSetPlane(drm.fd, drm.planeId, drm.crtcId, fb, 0, 0, 0, drm.mode.hdisplay, drm.mode.vdisplay, 0, 0,
-						drm.mode.hdisplay << 16, drm.mode.vdisplay << 16))
-		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
-				
-	if (gbm.previousBo)
+	uint32_t fb = bufferObjectFb(bo);
+
+	if (!drm.atomic)
+	{
+		if (drmModeSetPlane(drm.fd, drm.planeId, drm.crtcId, fb, 0, 0, 0, drm.mode.hdisplay, drm.mode.vdisplay, 0, 0,
+							drm.mode.hdisplay << 16, drm.mode.vdisplay << 16))
+			throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+
+		if (gbm.previousBo)
+			gbm_surface_release_buffer(gbm.surface, gbm.previousBo);
+		gbm.previousBo = bo;
+		present_timing.flipped = latencyNow();
+		return;
+	}
+
+	// Once the last commit has flipped, the buffer it replaced is free.
+	if (gbm.pendingBo)
+	{
+		present_timing.previousFlipped = waitForFlip();
+		if (gbm.previousBo)
+			gbm_surface_release_buffer(gbm.surface, gbm.previousBo);
+		gbm.previousBo = gbm.pendingBo;
+		gbm.pendingBo = NULL;
+	}
+
+	atomicCommit(fb);
+	gbm.pendingBo = bo;
+	present_timing.flipPending = true;
+}
+
+// Scanout needs one YUV420 overlay plane per camera, on top of the primary
+// plane that the GL path draws to.
+bool setupScanout(unsigned int cameras)
+{
+	if (display_mode != "DRM" || !drm.atomic)
+	{
+		printf("Direct scanout needs DRM atomic modesetting, using GL\n");
+		return false;
+	}
+
+	std::vector<uint32_t> used = { drm.planeId };
+	for (unsigned int i = 0; i < cameras; i++)
 	{
-		drmModeRmFB(drm.fd, gbm.previousFb);
-		gbm_surface_release_buffer(gbm.surface, gbm.previousBo);
+		ScanoutPlane plane = {};
+		plane.planeId = findPlane(DRM_FORMAT_YUV420, used);
+		if (!plane.planeId || !getPlaneProps(plane.planeId, plane.props))
+		{
+			printf("Only %u of %u YUV420 planes available for direct scanout, using GL\n", i, cameras);
+			scanout_planes.clear();
+			return false;
+		}
+		used.push_back(plane.planeId);
+		scanout_planes.push_back(plane);
+	}
+
+	printf("Direct scanout on %u overlay planes\n", cameras);
+	return true;
+}
+
+// Wrap the buffer as a framebuffer the first time it is seen and stage it on
+// the camera's plane for the next scanoutCommit().
+void scanoutBuffer(int camera_num, libcamera::FrameBuffer *buffer, libcamera::StreamConfiguration const &info)
+{
+	ScanoutFb &fb = cacheEntry(scanout_cache, camera_num, buffer);
+	if (fb.buffer != buffer)
+	{
+		releaseScanoutFb(fb);
+		fb = { nullptr, 0, 0 };
+		if (drmPrimeFDToHandle(drm.fd, buffer->planes()[0].fd.get(), &fb.handle))
+			throw std::runtime_error("drmPrimeFDToHandle failed: " + std::string(ERRSTR));
+
+		uint32_t stride = info.stride;
+		uint32_t handles[4] = { fb.handle, fb.handle, fb.handle };
+		uint32_t pitches[4] = { stride, stride / 2, stride / 2 };
+		uint32_t offsets[4] = { 0, stride * info.size.height,
+					stride * info.size.height + (stride / 2) * (info.size.height / 2) };
+		if (drmModeAddFB2(drm.fd, info.size.width, info.size.height, DRM_FORMAT_YUV420,
+				  handles, pitches, offsets, &fb.id, 0))
+		{
+			struct drm_gem_close close_handle = { fb.handle, 0 };
+			drmIoctl(drm.fd, DRM_IOCTL_GEM_CLOSE, &close_handle);
+			throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
+		}
+
+		fb.buffer = buffer;
+		cache_stats.misses++;
 	}
-	gbm.previousBo = bo;
-	gbm.previousFb = fb;
+	else
+		cache_stats.hits++;
+
+	ScanoutPlane &plane = scanout_planes[camera_num];
+	plane.fb = fb.id;
+	plane.width = info.size.width;
+	plane.height = info.size.height;
+}
+
+// Put every camera's staged buffer on screen with one atomic commit. This
+// waits for the previous commit to flip first, so the caller may then hand
+// back whatever that commit replaced. Returns false if the driver rejected
+// the commit, in which case the caller should disableScanout() and draw with
+// GL instead.
+bool scanoutCommit()
+{
+	present_timing.previousFlipped = waitForFlip();
+
+	unsigned int count = scanout_planes.size();
+	unsigned int cols = 1;
+	while (cols * cols < count)
+		cols++;
+	unsigned int rows = count ? (count + cols - 1) / cols : 1;
+	int cell_width = drm.mode.hdisplay / cols;
+	int cell_height = drm.mode.vdisplay / rows;
+
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		ScanoutPlane const &plane = scanout_planes[i];
+		if (!plane.fb)
+			continue;
+		// Same grid as displayFrame(), but CRTC coordinates start at the top.
+		addPlane(req, plane.planeId, plane.props, plane.fb, plane.width, plane.height,
+			 (i % cols) * cell_width, (i / cols) * cell_height, cell_width, cell_height);
+	}
+
+	if (commitWithFlipEvent(req))
+	{
+		printf("Direct scanout commit failed: %s\n", ERRSTR);
+		return false;
+	}
+
+	present_timing.swapped = latencyNow();
+	present_timing.flipped = 0;
+	present_timing.flipPending = true;
+	return true;
+}
+
+// Take the overlay planes down, blocking until they are off screen so that
+// every buffer they showed can be reused straight away.
+void disableScanout()
+{
+	if (scanout_planes.empty())
+		return;
+
+	waitForFlip();
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	for (ScanoutPlane const &plane : scanout_planes)
+		addPlane(req, plane.planeId, plane.props, 0, 0, 0, 0, 0, 0, 0);
+	drmModeAtomicCommit(drm.fd, req, 0, NULL);
+	drmModeAtomicFree(req);
+	scanout_planes.clear();
+}
+
+struct ViewRect
+{
+	float x, y, width, height; // pixels, origin bottom left as in GL
+};
+
+// The largest rectangle of the given aspect ratio centred in the cell.
+static ViewRect fitView(ViewRect cell, float aspect)
+{
+	ViewRect rect = cell;
+	if (cell.width > cell.height * aspect)
+	{
+		rect.width = cell.height * aspect;
+		rect.x += (cell.width - rect.width) / 2;
+	}
+	else
+	{
+		rect.height = cell.width / aspect;
+		rect.y += (cell.height - rect.height) / 2;
+	}
+	return rect;
+}
+
+static bool fills(ViewRect const &rect, ViewRect const &cell)
+{
+	return rect.width >= cell.width - 1 && rect.height >= cell.height - 1;
+}
+
+// Place each view on screen. Returns true if together they cover all of it,
+// so that there is nothing to clear.
+static bool layoutViews(PreviewLayout layout, std::vector<float> const &aspects, int width, int height,
+			std::vector<ViewRect> &rects)
+{
+	unsigned int count = aspects.size();
+	rects.resize(count);
+	if (!count)
+		return false;
+
+	bool covered = true;
+	if (layout == PreviewLayout::PictureInPicture)
+	{
+		// Insets are a quarter of the screen across, stacked up the right.
+		ViewRect screen = { 0, 0, (float)width, (float)height };
+		rects[0] = fitView(screen, aspects[0]);
+		covered = fills(rects[0], screen);
+		float margin = height / 40.0f;
+		float top = margin;
+		for (unsigned int i = 1; i < count; i++)
+		{
+			rects[i] = fitView({ 0, 0, width * 0.25f, height * 0.25f }, aspects[i]);
+			rects[i].x = width - margin - rects[i].width;
+			rects[i].y = top;
+			top += rects[i].height + margin;
+		}
+		return covered;
+	}
+
+	// Grid: the smallest near-square grid that holds them all, filled left
+	// to right and top to bottom, so two cameras end up side by side.
+	unsigned int cols = 1;
+	if (layout == PreviewLayout::SideBySide)
+		cols = count;
+	else
+	{
+		while (cols * cols < count)
+			cols++;
+	}
+	unsigned int rows = (count + cols - 1) / cols;
+	float cell_width = width / (float)cols;
+	float cell_height = height / (float)rows;
+	covered = count == cols * rows;
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		ViewRect cell = { (i % cols) * cell_width, height - (i / cols + 1) * cell_height, cell_width, cell_height };
+		rects[i] = fitView(cell, aspects[i]);
+		covered = covered && fills(rects[i], cell);
+	}
+	return covered;
+}
+
+void setPreviewLayout(PreviewLayout layout)
+{
+	preview_layout = layout;
 }
 
 void displayFrame(int width, int height)
 {
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	
-	width = width/2;
-	
-	//Draw camera 1
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, egl.FramebufferName);
-	glViewport(0,0,width,height);
-	//glBindFramebuffer(GL_FRAMEBUFFER, 0);    // do i need this?
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-	
-	//Draw camera 2
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, egl.FramebufferName2);
-	glViewport(width,0,width,height);
-	//glBindFramebuffer(GL_FRAMEBUFFER, 0);    // do i need this?
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-	
-	eglSwapBuffers(egl.display, egl.surface);
+	TRACE_SCOPE("displayFrame");
+	unsigned int cameras = egl.cameraTextures.size();
+	bool aux = egl.auxTexture != 0;
+	setupCompositor(cameras, aux);
+
+	std::vector<float> aspects = egl.cameraAspects;
+	if (aux)
+		aspects.push_back(egl.auxAspect);
+	std::vector<ViewRect> rects;
+	if (!layoutViews(preview_layout, aspects, width, height, rects))
+	{
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+
+	// Rectangles in clip space for the vertex shader.
+	std::vector<float> uniforms;
+	for (ViewRect const &rect : rects)
+	{
+		uniforms.push_back(rect.x / width * 2 - 1);
+		uniforms.push_back(rect.y / height * 2 - 1);
+		uniforms.push_back(rect.width / width * 2);
+		uniforms.push_back(rect.height / height * 2);
+	}
+	glUniform4fv(egl.compositor.rects, rects.size(), uniforms.data());
+
+	for (unsigned int i = 0; i < cameras; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, egl.cameraTextures[i]);
+	}
+	if (aux)
+	{
+		glActiveTexture(GL_TEXTURE0 + cameras);
+		glBindTexture(GL_TEXTURE_2D, egl.auxTexture);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	glViewport(0, 0, width, height);
+	glDrawArrays(GL_TRIANGLES, 0, rects.size() * 6);
+
+	if (display_mode == "HEADLESS")
+	{
+		// Nothing to present, so wait for the GPU instead so that the frame
+		// rate reflects the real cost of rendering.
+		if (readback_path.empty())
+			glFinish();
+		else
+		{
+			readback_pixels.resize((size_t)width * height * 4);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, readback_pixels.data());
+		}
+		present_timing = { latencyNow(), 0, 0, false };
+		return;
+	}
+
+	{
+		TRACE_SCOPE("eglSwapBuffers");
+		eglSwapBuffers(egl.display, egl.surface);
+	}
+	present_timing = { latencyNow(), 0, 0, false };
+	// The legacy SetPlane call returns once the plane is updated, which is
+	// as close to the screen as we can observe, and fills in flipped. Atomic
+	// flips complete later, so the time of this frame's flip is reported
+	// with the next one as previousFlipped.
 	if (display_mode == "DRM")
 		gbmSwapBuffers();
-		
-	//std::cout << "displayed frame\n";
+}
+
+CpuTarget cpuTarget()
+{
+	if (cpu.target.data)
+		return cpu.target;
+
+	if (display_mode == "DRM")
+	{
+		// A dumb buffer the size of the mode, on the plane the GL path used.
+		// It is scanned out as it is written, so there is no page flip.
+		struct drm_mode_create_dumb create = {};
+		create.width = drm.mode.hdisplay;
+		create.height = drm.mode.vdisplay;
+		create.bpp = 32;
+		if (drmIoctl(drm.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+			throw std::runtime_error("failed to create dumb buffer: " + std::string(ERRSTR));
+		cpu.dumbHandle = create.handle;
+		cpu.mapSize = create.size;
+
+		uint32_t handles[4] = { create.handle };
+		uint32_t pitches[4] = { create.pitch };
+		uint32_t offsets[4] = { 0 };
+		if (drmModeAddFB2(drm.fd, create.width, create.height, GBM_FORMAT_XRGB8888,
+				  handles, pitches, offsets, &cpu.fb, 0))
+			throw std::runtime_error("drmModeAddFB2 failed: " + std::string(ERRSTR));
+
+		struct drm_mode_map_dumb map = {};
+		map.handle = create.handle;
+		if (drmIoctl(drm.fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+			throw std::runtime_error("failed to map dumb buffer: " + std::string(ERRSTR));
+		void *data = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, drm.fd, map.offset);
+		if (data == MAP_FAILED)
+			throw std::runtime_error("failed to map dumb buffer: " + std::string(ERRSTR));
+		memset(data, 0, create.size);
+
+		if (drm.atomic)
+			waitForFlip();
+		if (drmModeSetPlane(drm.fd, drm.planeId, drm.crtcId, cpu.fb, 0, 0, 0, create.width, create.height,
+				    0, 0, create.width << 16, create.height << 16))
+			throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
+
+		cpu.target = { static_cast<uint8_t *>(data), create.width, create.height, create.pitch };
+	}
+	else
+	{
+		unsigned int stride = width * 4;
+		uint8_t *data = static_cast<uint8_t *>(calloc((size_t)stride * height, 1));
+		if (!data)
+			throw std::runtime_error("failed to allocate CPU preview buffer");
+
+		if (display_mode == "X11")
+		{
+			int screen = DefaultScreen(X11.display);
+			cpu.image = XCreateImage(X11.display, DefaultVisual(X11.display, screen), DefaultDepth(X11.display, screen),
+						 ZPixmap, 0, reinterpret_cast<char *>(data), width, height, 32, stride);
+			if (!cpu.image)
+			{
+				free(data);
+				throw std::runtime_error("XCreateImage failed");
+			}
+		}
+		cpu.target = { data, (unsigned int)width, (unsigned int)height, stride };
+	}
+
+	printf("Drawing on the CPU at %ux%u\n", cpu.target.width, cpu.target.height);
+	return cpu.target;
+}
+
+void cpuPresent()
+{
+	if (cpu.image)
+	{
+		XPutImage(X11.display, X11.window, DefaultGC(X11.display, DefaultScreen(X11.display)), cpu.image,
+			  0, 0, 0, 0, cpu.target.width, cpu.target.height);
+		XFlush(X11.display);
+	}
+	uint64_t now = latencyNow();
+	present_timing = { now, now, 0, false };
+}
+
+static void releaseCpuTarget()
+{
+	if (!cpu.target.data)
+		return;
+
+	if (cpu.fb)
+	{
+		struct drm_mode_destroy_dumb destroy = { cpu.dumbHandle };
+		munmap(cpu.target.data, cpu.mapSize);
+		drmModeRmFB(drm.fd, cpu.fb);
+		drmIoctl(drm.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	else if (cpu.image)
+		XDestroyImage(cpu.image); // frees the pixels too
+	else
+		free(cpu.target.data);
+	cpu = {};
+}
+
+void setAuxView(const uint8_t *gray, unsigned int width, unsigned int height)
+{
+	if (first_time_)
+		return;
+
+	if (!egl.auxTexture)
+	{
+		glGenTextures(1, &egl.auxTexture);
+		glBindTexture(GL_TEXTURE_2D, egl.auxTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, egl.auxTexture);
+
+	egl.auxAspect = width / (float)height;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, gray);
+}
+
+PresentTiming lastPresentTiming()
+{
+	return present_timing;
+}
+
+EGLSyncKHR createFence()
+{
+	if (!egl.fenceSync)
+	{
+		glFinish();
+		return EGL_NO_SYNC_KHR;
+	}
+
+	EGLSyncKHR fence = eglCreateSyncKHR(egl.display, EGL_SYNC_FENCE_KHR, NULL);
+	if (fence == EGL_NO_SYNC_KHR)
+		glFinish();
+	return fence;
+}
+
+bool waitFence(EGLSyncKHR fence, uint64_t timeout_ns)
+{
+	if (fence == EGL_NO_SYNC_KHR)
+		return true;
+
+	// The flush makes sure the fence is on its way to the GPU at all.
+	EGLint ret = eglClientWaitSyncKHR(egl.display, fence, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, timeout_ns);
+	// An error leaves nothing to wait for, so don't hold frames back on it.
+	return ret != EGL_TIMEOUT_EXPIRED_KHR;
+}
+
+void destroyFence(EGLSyncKHR fence)
+{
+	if (fence != EGL_NO_SYNC_KHR)
+		eglDestroySyncKHR(egl.display, fence);
 }
 
 void gbmClean()
 {
+    disableScanout();
+
+
     // set the previous crtc
     drmModeSetCrtc(drm.fd, drm.crtc->crtc_id, drm.crtc->buffer_id, drm.crtc->x, drm.crtc->y, &drm.conId, 1, &drm.crtc->mode);
     drmModeFreeCrtc(drm.crtc);
 
-    if (gbm.previousBo)
+    if (gbm.pendingBo)
     {
-        drmModeRmFB(drm.fd, gbm.previousFb);
-        gbm_surface_release_buffer(gbm.surface, gbm.previousBo);
+        waitForFlip();
+        gbm_surface_release_buffer(gbm.surface, gbm.pendingBo);
     }
+    if (gbm.previousBo)
+        gbm_surface_release_buffer(gbm.surface, gbm.previousBo);
 
+    // Destroying the surface also removes the framebuffers cached on its BOs.
     gbm_surface_destroy(gbm.surface);
     gbm_device_destroy(gbm.device);
 }
 
+static void writeReadback()
+{
+	if (!readback_path.empty() && display_mode == "HEADLESS" && cpu.target.data)
+	{
+		// CPU frames are XRGB8888, top row first.
+		std::ofstream out(readback_path, std::ios::binary);
+		out << "P6\n" << cpu.target.width << " " << cpu.target.height << "\n255\n";
+		for (unsigned int row = 0; row < cpu.target.height; row++)
+		{
+			const uint8_t *pixel = cpu.target.data + (size_t)row * cpu.target.stride;
+			for (unsigned int col = 0; col < cpu.target.width; col++, pixel += 4)
+			{
+				const char rgb[3] = { (char)pixel[2], (char)pixel[1], (char)pixel[0] };
+				out.write(rgb, 3);
+			}
+		}
+		std::cout << "Wrote last frame to " << readback_path << std::endl;
+		return;
+	}
+
+	if (readback_path.empty() || readback_pixels.empty())
+		return;
+
+	// GL rows start at the bottom, PPM rows at the top.
+	std::ofstream out(readback_path, std::ios::binary);
+	out << "P6\n" << width << " " << height << "\n255\n";
+	for (int row = height - 1; row >= 0; row--)
+	{
+		const uint8_t *pixel = &readback_pixels[(size_t)row * width * 4];
+		for (int col = 0; col < width; col++, pixel += 4)
+			out.write(reinterpret_cast<const char *>(pixel), 3);
+	}
+	std::cout << "Wrote last frame to " << readback_path << std::endl;
+}
+
+// Called by the thread that has been drawing, before it exits, so that
+// cleanup() can run from another thread.
+void releasePreview()
+{
+	if (display_mode == "HEADLESS" && !first_time_)
+	{
+		glDeleteFramebuffers(1, &egl.offscreenFbo);
+		glDeleteTextures(1, &egl.offscreenTexture);
+	}
+	invalidateBufferCache(-1);
+	if (egl.auxTexture)
+	{
+		glDeleteTextures(1, &egl.auxTexture);
+		egl.auxTexture = 0;
+	}
+	if (egl.compositor.program)
+		glDeleteProgram(egl.compositor.program);
+	egl.compositor = {};
+	eglMakeCurrent(egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	first_time_ = true;
+}
+
 void cleanup()
 {
+	invalidateBufferCache(-1);
+	writeReadback();
+	releaseCpuTarget();
 	eglDestroyContext(egl.display, egl.context);
-	eglDestroySurface(egl.display, egl.surface);
+	if (egl.surface != EGL_NO_SURFACE)
+		eglDestroySurface(egl.display, egl.surface);
 	eglTerminate(egl.display);
 	
 	if (display_mode == "DRM")
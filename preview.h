@@ -1,6 +1,7 @@
 #pragma once
 
 #include <map>
+#include <vector>
 
 #include <libcamera/libcamera.h>
 
@@ -29,8 +30,48 @@ struct EGLUtil
 	EGLint vid;
 	EGLint num_configs;
 	
-	GLuint FramebufferName;
-	GLuint FramebufferName2;
+	std::vector<GLuint> cameraTextures; // texture of the latest frame per camera
+	std::vector<float> cameraAspects;   // width / height of each camera's frames
+
+	GLuint offscreenFbo;     // headless render target
+	GLuint offscreenTexture;
+
+	bool fenceSync;          // EGL_KHR_fence_sync
+
+	GLuint auxTexture;       // a grey image such as a depth map, drawn after the cameras
+	float auxAspect;
+
+	struct
+	{
+		GLuint program;
+		GLint rects;           // per view x, y, width, height in clip space
+		unsigned int cameras;  // views the program was built for
+		bool aux;
+		std::vector<float> vertices;
+	} compositor;
+};
+
+// How displayFrame() arranges the cameras (and the aux image after them).
+// Every view keeps its aspect ratio.
+enum class PreviewLayout
+{
+	Grid,             // smallest near-square grid, left to right, top to bottom
+	SideBySide,       // one row
+	PictureInPicture, // camera 0 full screen, the rest inset bottom right
+};
+
+struct PresentTiming
+{
+	uint64_t swapped;         // eglSwapBuffers() returned, see latencyNow()
+	uint64_t flipped;         // the frame reached the screen, 0 if unknown
+	uint64_t previousFlipped; // flip of the previous frame, learned this frame
+	bool flipPending;         // this frame's flip time comes with the next one
+};
+
+struct ImageCacheStats
+{
+	uint64_t hits;   // frames whose buffer was already imported
+	uint64_t misses; // frames that needed a new EGLImage
 };
 
 static const EGLint ctx_attribs[] = {
@@ -48,6 +89,15 @@ static const EGLint conf_attribs[] = {
 	EGL_NONE
 };
 
+static const EGLint headless_conf_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 8,
+	EGL_GREEN_SIZE, 8,
+	EGL_BLUE_SIZE, 8,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_NONE
+};
+
 struct X11Util
 {
 	Display *display;
@@ -55,6 +105,13 @@ struct X11Util
 	Window window;
 };
 
+struct PlaneProps
+{
+	uint32_t fbId, crtcId;
+	uint32_t srcX, srcY, srcW, srcH;
+	uint32_t crtcX, crtcY, crtcW, crtcH;
+};
+
 struct DRMUtil
 {
 	drmModeRes *resources;
@@ -67,19 +124,54 @@ struct DRMUtil
 	uint32_t crtcId;
 	int crtcIdx;
 	uint32_t planeId;
+
+	bool atomic = false;  // DRM_CLIENT_CAP_ATOMIC accepted
+	PlaneProps planeProps;
 };
 
 struct GBMUtil
 {
 	gbm_device *device;
 	gbm_surface *surface;
-	uint32_t fb;
-	gbm_bo *previousBo = NULL;
-	uint32_t previousFb;
+	gbm_bo *previousBo = NULL; // on screen
+	gbm_bo *pendingBo = NULL;  // committed, waiting for its page flip
 };
 
-int makeWindow(char const *name, int x, int y, int width, int height);
+int makeWindow(char const *name, int x, int y, int width, int height, bool headless = false);
+void setReadback(std::string const &path);
 void makeBuffer(int fd, libcamera::StreamConfiguration const &cfg, libcamera::FrameBuffer *buffer, int camera_num);
+void invalidateBufferCache(int camera_num); // camera_num < 0 drops every entry
+ImageCacheStats imageCacheStats();
+void setPreviewLayout(PreviewLayout layout);
 void displayFrame(int width, int height);
+// Show a grey image in one more grid cell after the cameras, until replaced.
+void setAuxView(const uint8_t *gray, unsigned int width, unsigned int height);
+PresentTiming lastPresentTiming();
+// Fences after the GPU work drawn so far, see EGL_KHR_fence_sync. Without
+// the extension createFence() waits for the GPU instead and returns
+// EGL_NO_SYNC_KHR, which counts as signalled.
+EGLSyncKHR createFence();
+bool waitFence(EGLSyncKHR fence, uint64_t timeout_ns); // 0 only polls
+void destroyFence(EGLSyncKHR fence);
+int displayEventFd();
+void handleDisplayEvents();
+
+// Direct scanout of camera buffers to YUV overlay planes, DRM atomic only.
+bool setupScanout(unsigned int cameras);
+void scanoutBuffer(int camera_num, libcamera::FrameBuffer *buffer, libcamera::StreamConfiguration const &info);
+bool scanoutCommit();
+void disableScanout();
+// CPU drawing, for when EGL can't import the camera buffers: frames are
+// composed into this XRGB8888 buffer, which is a DRM dumb buffer on screen,
+// an XImage put to the window, or kept for the readback when headless.
+struct CpuTarget
+{
+	uint8_t *data;
+	unsigned int width, height, stride;
+};
+CpuTarget cpuTarget();
+void cpuPresent();
+
+void releasePreview();
 void gbmClean();
 void cleanup();
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * raw_recorder.cpp - Write raw frames to disk on a thread of their own
+ */
+
+#include "raw_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace libcamera;
+
+/* O_DIRECT wants offsets, sizes and memory aligned to the logical block. */
+static constexpr size_t kAlign = 4096;
+
+static size_t alignUp(size_t size)
+{
+	return (size + kAlign - 1) & ~(kAlign - 1);
+}
+
+size_t rawPayloadSize(StreamConfiguration const &config)
+{
+	return (size_t)config.stride * config.size.height * 3 / 2;
+}
+
+RawRecorder::RawRecorder(std::string const &prefix, std::vector<unsigned int> const &cameras,
+			 std::vector<StreamConfiguration> const &configs, unsigned int queueDepth)
+	: prefix_(prefix), queueDepth_(queueDepth), stopping_(false),
+	  written_(0), dropped_(0), failed_(0), bytes_(0)
+{
+	size_t record = 0;
+	for (unsigned int camera : cameras) {
+		record = std::max(record, alignUp(sizeof(RawFrameHeader) + rawPayloadSize(configs[camera])));
+		if (fds_.size() <= camera)
+			fds_.resize(camera + 1, -1);
+
+		std::string path = prefix_ + "-cam" + std::to_string(camera) + ".raw";
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, 0644);
+		/* tmpfs and some FUSE filesystems refuse O_DIRECT. */
+		if (fd < 0 && errno == EINVAL)
+			fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+		fds_[camera] = fd;
+	}
+
+	/* Touched now, so that the first frames don't fault the pages in. */
+	staging_.resize(queueDepth_, Staging{ nullptr, 0, 0, Frame{}, nullptr, 0 });
+	for (Staging &staging : staging_) {
+		staging.data = static_cast<uint8_t *>(aligned_alloc(kAlign, record));
+		if (!staging.data)
+			throw std::runtime_error("failed to allocate recording buffer");
+		memset(staging.data, 0, record);
+		staging.capacity = record;
+	}
+
+	free_ = std::make_unique<CompletionQueue<unsigned int>>(queueDepth_);
+	queued_ = std::make_unique<CompletionQueue<unsigned int>>(queueDepth_);
+	for (unsigned int i = 0; i < queueDepth_; i++)
+		free_->push(i);
+}
+
+RawRecorder::~RawRecorder()
+{
+	stop();
+	for (int fd : fds_) {
+		if (fd >= 0)
+			close(fd);
+	}
+	for (Staging &staging : staging_)
+		free(staging.data);
+}
+
+bool RawRecorder::records(unsigned int camera) const
+{
+	return camera < fds_.size() && fds_[camera] >= 0;
+}
+
+void RawRecorder::start()
+{
+	stopping_ = false;
+	thread_ = std::thread(&RawRecorder::run, this);
+}
+
+void RawRecorder::stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+}
+
+bool RawRecorder::write(const Frame &frame, std::vector<Span<uint8_t>> const &mapping)
+{
+	if (!records(frame.source))
+		return false;
+
+	unsigned int index;
+	if (!free_->pop(index)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	StreamConfiguration const &config = *frame.config;
+	size_t payload = rawPayloadSize(config);
+	size_t available = 0;
+	for (Span<uint8_t> const &span : mapping)
+		available += span.size();
+	if (payload > available)
+		payload = available;
+
+	/* Only a stream reconfigured since the recorder was made can be larger. */
+	Staging &staging = staging_[index];
+	size_t record = alignUp(sizeof(RawFrameHeader) + payload);
+	if (staging.capacity < record) {
+		failed_.fetch_add(1, std::memory_order_relaxed);
+		free_->push(index);
+		return false;
+	}
+
+	staging.size = record;
+	staging.frame = frame;
+	staging.mapping = &mapping;
+	staging.payload = payload;
+
+	/* Both rings hold every index, so this can't fail. */
+	queued_->push(index);
+	{
+		/* Taking the lock keeps the wakeup from landing before the writer waits. */
+		std::unique_lock<std::mutex> locker(lock_);
+	}
+	cond_.notify_one();
+	return true;
+}
+
+/* Writer thread: copy the held frame into its record, then let it go. */
+void RawRecorder::fill(Staging &staging)
+{
+	const Frame &frame = staging.frame;
+	StreamConfiguration const &config = *frame.config;
+
+	RawFrameHeader header = {};
+	memcpy(header.magic, "SCRF", 4);
+	header.headerSize = sizeof(header);
+	header.recordSize = staging.size;
+	header.payloadSize = staging.payload;
+	header.camera = frame.source;
+	header.sequence = frame.sequence;
+	header.timestamp = frame.timestamp;
+	header.width = config.size.width;
+	header.height = config.size.height;
+	header.stride = config.stride;
+
+	uint8_t *dst = staging.data;
+	memcpy(dst, &header, sizeof(header));
+	dst += sizeof(header);
+	size_t remaining = staging.payload;
+	for (Span<uint8_t> const &span : *staging.mapping) {
+		size_t length = std::min(remaining, span.size());
+		memcpy(dst, span.data(), length);
+		dst += length;
+		remaining -= length;
+	}
+	memset(dst, 0, staging.data + staging.size - dst);
+
+	staging.mapping = nullptr;
+	release_(frame);
+}
+
+RecorderStats RawRecorder::stats() const
+{
+	return { written_.load(std::memory_order_relaxed), dropped_.load(std::memory_order_relaxed),
+		 failed_.load(std::memory_order_relaxed), bytes_.load(std::memory_order_relaxed) };
+}
+
+void RawRecorder::run()
+{
+	while (true) {
+		unsigned int index;
+		bool queued = false;
+		{
+			/* Whatever is queued still gets written once stopping. */
+			std::unique_lock<std::mutex> locker(lock_);
+			cond_.wait(locker, [this, &index, &queued]() {
+				queued = queued_->pop(index);
+				return queued || stopping_;
+			});
+		}
+		if (!queued)
+			break;
+
+		Staging &staging = staging_[index];
+		fill(staging);
+		int fd = fds_[staging.frame.source];
+		size_t done = 0;
+		while (done < staging.size) {
+			ssize_t ret = ::write(fd, staging.data + done, staging.size - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+
+		if (done == staging.size) {
+			written_.fetch_add(1, std::memory_order_relaxed);
+			bytes_.fetch_add(done, std::memory_order_relaxed);
+		} else
+			failed_.fetch_add(1, std::memory_order_relaxed);
+
+		free_->push(index);
+	}
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "completion_queue.h"
+#include "frame_source.h"
+
+/*
+ * Each record in a raw file is this header followed by the frame's YUV420
+ * planes as laid out in the buffer (stride bytes per luma row), padded with
+ * zeros to recordSize, a multiple of 4096.
+ */
+struct RawFrameHeader
+{
+	char magic[4];        // "SCRF"
+	uint32_t headerSize;  // sizeof(RawFrameHeader)
+	uint32_t recordSize;  // header, payload and padding
+	uint32_t payloadSize;
+	uint32_t camera;
+	uint32_t sequence;
+	uint64_t timestamp;   // sensor timestamp, CLOCK_MONOTONIC ns
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t reserved;
+};
+
+/* Bytes of YUV420 a frame of this stream carries in a record. */
+size_t rawPayloadSize(libcamera::StreamConfiguration const &config);
+
+struct RecorderStats
+{
+	uint64_t written;
+	uint64_t dropped;  // no free staging buffer, the writer is behind
+	uint64_t failed;   // write errors, or frames larger than configured
+	uint64_t bytes;
+};
+
+/*
+ * Streams frames to one file per camera from a writer thread of its own.
+ * write() only claims one of a fixed set of aligned staging buffers and
+ * holds the frame; the writer copies it into the staging buffer, hands the
+ * frame back and writes the record. The capture path never waits on the
+ * disk: when every staging buffer is still queued the frame is dropped and
+ * counted instead.
+ *
+ * The staging buffers are allocated and faulted in up front, each big
+ * enough for a record of any camera being recorded, as O_DIRECT can't
+ * write from a buffer that is grown later. Files are opened with O_DIRECT
+ * where the filesystem allows it, to keep hours of frames out of the page
+ * cache.
+ */
+class RawRecorder
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+
+	/* configs has an entry for every camera, recorded or not. */
+	RawRecorder(std::string const &prefix, std::vector<unsigned int> const &cameras,
+		    std::vector<libcamera::StreamConfiguration> const &configs, unsigned int queueDepth);
+	~RawRecorder();
+
+	bool records(unsigned int camera) const;
+
+	/* Called from the writer thread once a frame has been copied. */
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+
+	void start();
+	void stop();
+
+	/*
+	 * Called from the event loop. Returns true if the frame is held, in
+	 * which case it comes back through the release handler and the mapping
+	 * must stay valid until then.
+	 */
+	bool write(const Frame &frame, std::vector<libcamera::Span<uint8_t>> const &mapping);
+
+	RecorderStats stats() const;
+
+private:
+	struct Staging
+	{
+		uint8_t *data;
+		size_t capacity;
+		size_t size;
+		/* Set by write(), for the writer to copy from. */
+		Frame frame;
+		std::vector<libcamera::Span<uint8_t>> const *mapping;
+		size_t payload;
+	};
+
+	void run();
+	void fill(Staging &staging);
+
+	std::string prefix_;
+	std::vector<int> fds_; // by camera, -1 when not recorded
+	unsigned int queueDepth_;
+
+	std::vector<Staging> staging_;
+	std::unique_ptr<CompletionQueue<unsigned int>> free_;
+	std::unique_ptr<CompletionQueue<unsigned int>> queued_;
+	ReleaseHandler release_;
+
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stopping_;
+
+	std::atomic<uint64_t> written_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> failed_;
+	std::atomic<uint64_t> bytes_;
+};
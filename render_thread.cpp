@@ -0,0 +1,418 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * render_thread.cpp - Draw camera frames on a thread of their own
+ */
+
+#include "render_thread.h"
+#include "preview.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <iostream>
+
+RenderThread::RenderThread(unsigned int cameras, int width, int height)
+	: stopping_(false), mailbox_(cameras, Mailbox{ { Frame{} }, 0, 0 }), policy_(MailboxPolicy::Newest),
+	  drawing_(cameras, Frame{}),
+	  replaced_(cameras, Frame{}), width_(width), height_(height),
+	  scanout_(false), queued_(cameras, Frame{}), shown_(cameras, Frame{}),
+	  displayed_(cameras, Frame{}), cpu_(false), cpuThreads_(0), images_(cameras), auxFresh_(false), auxWidth_(0), auxHeight_(0),
+	  latency_(nullptr), trace_(nullptr), rendered_(0), totalRendered_(0), superseded_(0)
+{
+	unflipped_.reserve(cameras);
+}
+
+RenderThread::~RenderThread()
+{
+	stop();
+}
+
+void RenderThread::setMailbox(unsigned int depth, MailboxPolicy policy)
+{
+	for (Mailbox &mailbox : mailbox_)
+		mailbox = { std::vector<Frame>(std::max(1u, depth), Frame{}), 0, 0 };
+	policy_ = policy;
+}
+
+void RenderThread::start()
+{
+	stopping_ = false;
+	thread_ = std::thread(&RenderThread::run, this);
+}
+
+void RenderThread::stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+
+	/* Anything still waiting to be drawn goes back to its camera. */
+	for (Mailbox &mailbox : mailbox_) {
+		for (; mailbox.count; mailbox.count--) {
+			release_(mailbox.frames[mailbox.head]);
+			mailbox.frames[mailbox.head] = {};
+			mailbox.head = (mailbox.head + 1) % mailbox.frames.size();
+		}
+	}
+	releaseHeld();
+}
+
+void RenderThread::releaseHeld()
+{
+	for (std::vector<Frame> *held : { &shown_, &queued_ }) {
+		for (Frame &frame : *held) {
+			if (frame.buffer)
+				release_(frame);
+			frame = {};
+		}
+	}
+}
+
+/*
+ * Hand the frames in drawing_ to the overlay planes. Returns false, having
+ * switched back to GL for good, if the display won't take them.
+ */
+bool RenderThread::scanout()
+{
+	for (const Frame &frame : drawing_) {
+		if (!frame.buffer)
+			continue;
+
+		scanoutBuffer(frame.source, frame.buffer, *frame.config);
+		if (latency_)
+			latency_->timing(frame.source, frame.slot).imported = latencyNow();
+	}
+
+	if (!scanoutCommit()) {
+		disableScanout();
+		releaseHeld();
+		scanout_ = false;
+		return false;
+	}
+
+	/* The previous commit has flipped, so what it replaced is free. */
+	for (unsigned int i = 0; i < drawing_.size(); i++) {
+		if (queued_[i].buffer) {
+			if (shown_[i].buffer)
+				release_(shown_[i]);
+			shown_[i] = queued_[i];
+			queued_[i] = {};
+		}
+		queued_[i] = drawing_[i];
+	}
+	return true;
+}
+
+bool RenderThread::submit(const std::vector<Frame> &frames)
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		if (policy_ == MailboxPolicy::Block) {
+			for (unsigned int i = 0; i < frames.size(); i++) {
+				if (frames[i].buffer && mailbox_[i].count == mailbox_[i].frames.size())
+					return false;
+			}
+		}
+
+		for (unsigned int i = 0; i < frames.size(); i++) {
+			if (!frames[i].buffer)
+				continue;
+
+			Mailbox &mailbox = mailbox_[i];
+			unsigned int depth = mailbox.frames.size();
+			if (mailbox.count == depth) {
+				replaced_[i] = mailbox.frames[mailbox.head];
+				mailbox.head = (mailbox.head + 1) % depth;
+				mailbox.count--;
+			}
+			mailbox.frames[(mailbox.head + mailbox.count) % depth] = frames[i];
+			mailbox.count++;
+		}
+	}
+	cond_.notify_one();
+
+	for (Frame &frame : replaced_) {
+		if (!frame.buffer)
+			continue;
+		superseded_.fetch_add(1, std::memory_order_relaxed);
+		release_(frame);
+		frame = {};
+	}
+	return true;
+}
+
+/* Returns false, having switched to CPU drawing, if EGL can't take a frame. */
+bool RenderThread::importFrames()
+{
+	for (const Frame &frame : drawing_) {
+		if (!frame.buffer)
+			continue;
+
+		try {
+			int fd = frame.buffer->planes()[0].fd.get();
+			makeBuffer(fd, *frame.config, frame.buffer, frame.source);
+		} catch (std::exception const &e) {
+			if (!mapping_)
+				throw;
+			std::cerr << "EGL import failed (" << e.what() << "), drawing on the CPU" << std::endl;
+			cpu_ = true;
+			return false;
+		}
+
+		if (latency_)
+			latency_->timing(frame.source, frame.slot).imported = latencyNow();
+	}
+	return true;
+}
+
+void RenderThread::drawCpu()
+{
+	if (!compositor_) {
+		pool_ = std::make_unique<ThreadPool>(cpuThreads_);
+		compositor_ = std::make_unique<CpuCompositor>(*pool_);
+		std::cout << "CPU conversion: " << convertKernel() << " on " << pool_->size() << " threads" << std::endl;
+	}
+
+	for (unsigned int i = 0; i < drawing_.size(); i++) {
+		const Frame &frame = drawing_[i];
+		images_[i] = frame.buffer ? yuvImage(*frame.config, mapping_(frame)) : YuvImage{};
+		if (frame.buffer && latency_)
+			latency_->timing(frame.source, frame.slot).imported = latencyNow();
+	}
+
+	CpuTarget target = cpuTarget();
+	compositor_->setOutput(target.data, target.width, target.height, target.stride);
+	compositor_->draw(images_);
+	cpuPresent();
+}
+
+void RenderThread::showAux(std::vector<uint8_t> const &gray, unsigned int width, unsigned int height)
+{
+	std::unique_lock<std::mutex> locker(lock_);
+	/* Reuses the capacity of the last image, so this only allocates once. */
+	auxPending_.assign(gray.begin(), gray.end());
+	auxWidth_ = width;
+	auxHeight_ = height;
+	auxFresh_ = true;
+}
+
+RenderStats RenderThread::stats(bool reset)
+{
+	if (reset)
+		return { rendered_.exchange(0), superseded_.exchange(0) };
+	return { rendered_.load(), superseded_.load() };
+}
+
+/* The frame is now on its camera's texture, replacing the last one there. */
+void RenderThread::display(const Frame &frame)
+{
+	Frame &shown = displayed_[frame.source];
+	if (shown.buffer)
+		retired_.push_back(shown);
+	shown = frame;
+}
+
+/*
+ * Called after each GL draw. The frames it replaced were last sampled by the
+ * draw before, so they wait on that one's fence.
+ */
+void RenderThread::fenceDraw()
+{
+	if (!retired_.empty()) {
+		if (fenced_.empty()) {
+			for (Frame &frame : retired_)
+				release_(frame);
+		} else {
+			std::vector<Frame> &frames = fenced_.back().frames;
+			frames.insert(frames.end(), retired_.begin(), retired_.end());
+		}
+		retired_.clear();
+	}
+
+	fenced_.push_back({ createFence(), {} });
+	collectFences(false);
+}
+
+/*
+ * Release the frames of every signalled fence, oldest first. The latest
+ * fence is kept, more frames may be retired onto it.
+ */
+void RenderThread::collectFences(bool wait)
+{
+	while (!fenced_.empty()) {
+		Fenced &oldest = fenced_.front();
+		if (fenced_.size() == 1 && oldest.frames.empty())
+			break;
+		/* Bounded, in case the GPU has hung, so stop() still gets through. */
+		if (!waitFence(oldest.fence, wait ? 100000000 : 0))
+			break;
+
+		for (Frame &frame : oldest.frames)
+			release_(frame);
+		oldest.frames.clear();
+		if (fenced_.size() == 1)
+			break;
+		destroyFence(oldest.fence);
+		fenced_.pop_front();
+	}
+}
+
+bool RenderThread::fencedFrames() const
+{
+	for (const Fenced &fenced : fenced_) {
+		if (!fenced.frames.empty())
+			return true;
+	}
+	return false;
+}
+
+/* Wait for the GPU and give back everything GL drawing still holds. */
+void RenderThread::releaseDisplayed()
+{
+	for (Frame &frame : displayed_) {
+		if (frame.buffer)
+			retired_.push_back(frame);
+		frame = {};
+	}
+	if (!retired_.empty())
+		fenceDraw();
+
+	/* A hung GPU gets a second, then its frames go back regardless. */
+	uint64_t deadline = latencyNow() + 1000000000;
+	while (fencedFrames() && latencyNow() < deadline)
+		collectFences(true);
+	if (fencedFrames())
+		std::cerr << "GPU fences not signalled after 1s, releasing the frames anyway" << std::endl;
+	for (Fenced &fenced : fenced_) {
+		for (Frame &frame : fenced.frames)
+			release_(frame);
+		destroyFence(fenced.fence);
+	}
+	fenced_.clear();
+}
+
+void RenderThread::run()
+{
+	TRACE_THREAD("render");
+
+	while (true) {
+		bool auxUpdate = false;
+		unsigned int auxWidth = 0, auxHeight = 0;
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			bool ready = false;
+			cond_.wait(locker, [this, &ready]() {
+				ready = false;
+				for (const Mailbox &mailbox : mailbox_)
+					ready = ready || mailbox.count;
+				/* Frames behind a fence mustn't wait for the next set. */
+				return stopping_ || ready || fencedFrames();
+			});
+			if (stopping_)
+				break;
+
+			if (!ready) {
+				locker.unlock();
+				collectFences(true);
+				continue;
+			}
+
+			for (unsigned int i = 0; i < mailbox_.size(); i++) {
+				Mailbox &mailbox = mailbox_[i];
+				if (!mailbox.count)
+					continue;
+				drawing_[i] = mailbox.frames[mailbox.head];
+				mailbox.frames[mailbox.head] = {};
+				mailbox.head = (mailbox.head + 1) % mailbox.frames.size();
+				mailbox.count--;
+			}
+			if (auxFresh_) {
+				aux_.swap(auxPending_);
+				auxFresh_ = false;
+				auxUpdate = true;
+				auxWidth = auxWidth_;
+				auxHeight = auxHeight_;
+			}
+		}
+		if (policy_ == MailboxPolicy::Block && space_)
+			space_();
+
+		TRACE_SCOPE("render");
+		bool scannedOut = scanout_ && scanout();
+		bool drewGl = false;
+		if (!scannedOut) {
+			if (!cpu_ && importFrames()) {
+				/* Only the GL path has a cell for it. */
+				if (auxUpdate)
+					setAuxView(aux_.data(), auxWidth, auxHeight);
+				displayFrame(width_, height_);
+				drewGl = true;
+			}
+			else
+				drawCpu();
+		}
+		/* Nothing is left for the GPU to sample once off the GL path. */
+		if (!drewGl)
+			releaseDisplayed();
+		rendered_.fetch_add(1, std::memory_order_relaxed);
+		totalRendered_.fetch_add(1, std::memory_order_relaxed);
+
+		PresentTiming present = lastPresentTiming();
+		if (latency_) {
+			/* previousFlipped is 0 if the flip timed out, record the rest. */
+			for (PendingTiming &pending : unflipped_) {
+				pending.timing.flipped = present.previousFlipped;
+				latency_->record(pending.camera, pending.timing);
+			}
+		}
+		unflipped_.clear();
+
+		for (Frame &frame : drawing_) {
+			if (!frame.buffer)
+				continue;
+
+			if (trace_)
+				trace_->mark(frame.source, StartupTrace::FirstDisplayed);
+			TRACE_FLOW_END("frame", traceFrameId(frame.source, frame.sequence));
+			if (latency_) {
+				FrameTiming &timing = latency_->timing(frame.source, frame.slot);
+				timing.swapped = present.swapped;
+				timing.flipped = present.flipped;
+				/*
+				 * With atomic KMS the flip time only arrives with the next
+				 * frame, so keep a copy: the slot is reused once released.
+				 */
+				if (present.flipPending)
+					unflipped_.push_back({ frame.source, timing });
+				else
+					latency_->record(frame.source, timing);
+			}
+
+			/*
+			 * Scanned out frames stay held until they leave the screen,
+			 * drawn ones until the GPU is done with them.
+			 */
+			if (drewGl)
+				display(frame);
+			else if (!scannedOut)
+				release_(frame);
+			frame = {};
+		}
+		if (drewGl)
+			fenceDraw();
+	}
+
+	releaseDisplayed();
+	/* Nothing may be left on the planes once their framebuffers go. */
+	if (scanout_)
+		disableScanout();
+	/* Let the main thread tear the preview down. */
+	releasePreview();
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+#include "latency.h"
+#include "startup_trace.h"
+#include "thread_pool.h"
+#include "yuv_convert.h"
+
+struct RenderStats
+{
+	uint64_t rendered;   // frames drawn and swapped
+	uint64_t superseded; // frames replaced in the mailbox before being drawn
+};
+
+enum class MailboxPolicy
+{
+	Newest, // preview: a frame arriving at a full mailbox pushes out the oldest
+	Block,  // analysis: nothing is dropped, a full mailbox refuses new frames
+};
+
+/*
+ * Owns the EGL context and draws on its own thread, so a slow swap or page
+ * flip never holds up request recycling on the event loop. Completed frames
+ * are posted to a mailbox per camera, a single slot by default, and each
+ * draw takes the oldest frame of every camera. When a mailbox is full, the
+ * policy decides: with Newest the oldest undrawn frame is handed straight
+ * back through the release handler, with Block the new set is refused and
+ * stays with the caller, which then holds up the cameras instead, and the
+ * space handler says when to offer it again. The release handler is also
+ * called from the render thread once a frame has been drawn, and must be
+ * thread safe.
+ */
+class RenderThread
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+	using MappingHandler = std::function<std::vector<libcamera::Span<uint8_t>> const &(const Frame &)>;
+	using SpaceHandler = std::function<void()>;
+
+	RenderThread(unsigned int cameras, int width, int height);
+	~RenderThread();
+
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+	/*
+	 * With MailboxPolicy::Block, called from the render thread each time it
+	 * takes frames out of the mailboxes, so a refused set can be offered
+	 * again. A drawn frame stays held, so no release says so instead.
+	 */
+	void onSpace(const SpaceHandler &handler) { space_ = handler; }
+	void setLatencyTracker(LatencyTracker *latency) { latency_ = latency; }
+	void setStartupTrace(StartupTrace *trace) { trace_ = trace; }
+	/* Show frames on overlay planes instead of drawing them, see setupScanout(). */
+	void setScanout(bool scanout) { scanout_ = scanout; }
+	/*
+	 * CPU mappings of frames, for drawing them without EGL. That happens
+	 * with setCpu(true), or from the first frame EGL fails to import.
+	 */
+	void onMapping(const MappingHandler &handler) { mapping_ = handler; }
+	void setCpu(bool cpu) { cpu_ = cpu; }
+	/* Cores the CPU drawing may use, the render thread included; 0 is all. */
+	void setCpuThreads(unsigned int threads) { cpuThreads_ = threads; }
+	/* Frames each camera's mailbox holds, before start(). */
+	void setMailbox(unsigned int depth, MailboxPolicy policy);
+
+	void start();
+	void stop();
+
+	/*
+	 * Post a set of frames, one per camera. Called from the event loop.
+	 * Returns false if the set was refused, see MailboxPolicy::Block.
+	 */
+	bool submit(const std::vector<Frame> &frames);
+	/* Show a grey image, such as a depth map, next to the cameras. Any thread. */
+	void showAux(std::vector<uint8_t> const &gray, unsigned int width, unsigned int height);
+
+	RenderStats stats(bool reset = false);
+	uint64_t totalRendered() const { return totalRendered_.load(std::memory_order_relaxed); }
+
+private:
+	void run();
+	bool scanout();
+	void releaseHeld();
+	bool importFrames();
+	void drawCpu();
+	void display(const Frame &frame);
+	void fenceDraw();
+	void collectFences(bool wait);
+	void releaseDisplayed();
+
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stopping_;
+
+	/* Frames waiting to be drawn, a ring per camera, oldest at head. */
+	struct Mailbox
+	{
+		std::vector<Frame> frames;
+		unsigned int head;
+		unsigned int count;
+	};
+	std::vector<Mailbox> mailbox_;
+	MailboxPolicy policy_;
+	SpaceHandler space_;
+	std::vector<Frame> drawing_;
+	std::vector<Frame> replaced_;
+	int width_;
+	int height_;
+
+	/*
+	 * With direct scanout a buffer is in use until the commit after the one
+	 * that showed it has flipped: queued_ holds the frames of the last
+	 * commit, shown_ those of the one before, which are still on screen.
+	 */
+	bool scanout_;
+	std::vector<Frame> queued_;
+	std::vector<Frame> shown_;
+
+	/*
+	 * A camera's texture is sampled by every draw until its next frame
+	 * arrives, so displayed_ holds the frame each one shows. A frame it
+	 * replaces goes back once the GPU is past the last draw that used it:
+	 * each draw is fenced, oldest first in fenced_, with the frames it was
+	 * the last to sample.
+	 */
+	struct Fenced
+	{
+		void *fence; // EGLSyncKHR
+		std::vector<Frame> frames;
+	};
+	std::vector<Frame> displayed_;
+	std::vector<Frame> retired_;
+	std::deque<Fenced> fenced_;
+	bool fencedFrames() const;
+
+	bool cpu_;
+	unsigned int cpuThreads_;
+	MappingHandler mapping_;
+	std::unique_ptr<ThreadPool> pool_;
+	std::unique_ptr<CpuCompositor> compositor_;
+	std::vector<YuvImage> images_;
+
+	/* The latest aux image, swapped over with the next frame set. */
+	bool auxFresh_;
+	std::vector<uint8_t> auxPending_;
+	std::vector<uint8_t> aux_;
+	unsigned int auxWidth_;
+	unsigned int auxHeight_;
+
+	ReleaseHandler release_;
+	LatencyTracker *latency_;
+	StartupTrace *trace_;
+
+	/* Timings of the last frame, waiting for its page flip time. */
+	struct PendingTiming
+	{
+		unsigned int camera;
+		FrameTiming timing;
+	};
+	std::vector<PendingTiming> unflipped_;
+	std::atomic<uint64_t> rendered_;
+	std::atomic<uint64_t> totalRendered_;
+	std::atomic<uint64_t> superseded_;
+};
@@ -2,24 +2,46 @@
 /*
  * Copyright (C) 2022, Peyton Howe
  *
- * A simple dual-camera libcamera capture program
+ * A simple multi-camera libcamera capture program
  */
 
 #include <iomanip>
 #include <iostream>
 #include <string> 
+#include <sstream>
 #include <memory>
 #include <boost/lexical_cast.hpp>
-#include <queue>
-#include <sys/mman.h>
+#include <getopt.h>
+#include <chrono>
+#include <atomic>
+#include <signal.h>
+#include <deque>
+#include <exception>
+#include <thread>
+#include <algorithm>
 
+#include "camera_pipeline.h"
+#include "completion_queue.h"
 #include "event_loop.h"
+#include "frame_publisher.h"
+#include "frame_sync.h"
+#include "latency.h"
+#include "mjpeg_encoder.h"
+#include "motion_detector.h"
+#include "pretrigger_ring.h"
 #include "preview.h"
+#include "raw_recorder.h"
+#include "render_thread.h"
+#include "startup_trace.h"
+#include "stereo_depth.h"
+#include "synthetic_source.h"
+#include "trace.h"
 
 
 struct options
 {
 	int dual_cameras;
+	unsigned int num_cameras;
 	unsigned int width;
 	unsigned int height;
 	unsigned int prev_x, prev_y, prev_width, prev_height;
@@ -29,211 +51,273 @@ struct options
 	int exposure_index;
 	int timeout;
 	int buffer_count;
+	unsigned int sync_tolerance_us;
+	bool headless;
+	std::string readback;
+	unsigned int latency_interval;
+	unsigned int synthetic;
+	std::string jitter;
+	bool scanout;
+	std::string record;
+	std::vector<unsigned int> record_cameras;
+	unsigned int record_queue;
+	std::string pretrigger;
+	float pretrigger_seconds;
+	bool cpu;
+	unsigned int stereo_scale;
+	unsigned int stereo_disparities;
+	unsigned int stereo_block;
+	unsigned int motion_threshold;
+	unsigned int motion_scale;
+	std::string publish;
+	unsigned int publish_hold;
+	unsigned int publish_timeout_ms;
+	std::string layout;
+	unsigned int mailbox_depth;
+	std::string mailbox_policy;
+	std::string mjpeg;
+	int mjpeg_quality;
+	unsigned int mjpeg_threads;
+	std::string trace;
 };
 
 std::unique_ptr<options> options_;
 int cam_exposure_index;
-uint64_t last_timestamp_ = 0;
-uint64_t last_timestamp2_ = 0;
 
 using namespace libcamera;
 std::unique_ptr<CameraManager> cm;
-static std::shared_ptr<Camera> cameras[2];
-std::unique_ptr<CameraConfiguration> configs[2];
-std::vector<std::unique_ptr<Request>> requests[2];
-std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers[2];
-std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers[2];
-FrameBufferAllocator *allocators[2];
+static std::vector<std::unique_ptr<FrameSource>> sources;
 static EventLoop loop;
+static std::unique_ptr<FrameSync> frame_sync;
+static std::unique_ptr<RenderThread> render_thread;
+static std::unique_ptr<LatencyTracker> latency;
+static std::unique_ptr<RawRecorder> recorder;
+static std::unique_ptr<MjpegEncoder> mjpeg;
+static std::unique_ptr<PretriggerRing> pretrigger;
+static std::unique_ptr<StereoDepth> stereo;
+static std::unique_ptr<MotionDetector> motion;
+static std::unique_ptr<FramePublisher> publisher;
+static std::unique_ptr<StartupTrace> startup;
+// Cameras currently seeing motion. With --motion, --record only writes while
+// this is non-zero and the pre-trigger rings are flushed when it leaves zero.
+static unsigned int moving_cameras = 0;
+// Owners a frame has beyond the first, by source and slot. Only touched on
+// the event loop, which is where every release ends up.
+static std::vector<std::vector<unsigned int>> extra_holds;
+static volatile sig_atomic_t trigger_requested = 0;
 
-static void processRequest(Request *request);
-static void processRequest2(Request *request);
+// SIGUSR1 saves the pre-trigger rings; the flush starts on the event loop.
+static void triggerSignal(int signal)
+{
+	trigger_requested = 1;
+	loop.wakeup();
+}
+
+// Frame sets a full render mailbox turned away (--mailbox-policy block),
+// oldest first. They are offered again whenever the loop wakes, which the
+// render thread makes it do each time it empties a mailbox slot.
+static std::deque<std::vector<Frame>> render_backlog;
+static uint64_t delayed_sets = 0;
+
+// Frames the sensor never delivered, from gaps in each camera's sequence
+// numbers, as opposed to frames dropped after capture.
+static std::vector<uint32_t> next_sequence;
+static std::vector<uint64_t> sensor_lost;
+
+/*
+ * Sized for every slot of every source, so a push can't fail: a frame is
+ * only ever in each queue once. completions come from the sources (libcamera's
+ * thread for cameras), releases from the render thread once it is done with
+ * a frame; both are drained on the event loop.
+ */
+static std::unique_ptr<CompletionQueue<Frame>> completions;
+static std::unique_ptr<CompletionQueue<Frame>> releases;
+static std::atomic<uint64_t> completion_overflows(0);
 
-static void requestComplete(Request *request)
+static void postToLoop(CompletionQueue<Frame> &queue, const Frame &frame)
 {
-	if (request->status() == Request::RequestCancelled)
-		return;
-	loop.callLater(std::bind(&processRequest, request));
+	if (!queue.push(frame))
+		completion_overflows.fetch_add(1, std::memory_order_relaxed);
+	loop.wakeup();
+}
+
+// Runs in the source's thread, so it must not allocate or block.
+static void frameComplete(const Frame &frame)
+{
+	latency->timing(frame.source, frame.slot).completed = latencyNow();
+	startup->mark(frame.source, StartupTrace::FirstCompleted);
+	TRACE_FLOW_BEGIN("frame", traceFrameId(frame.source, frame.sequence));
+	postToLoop(*completions, frame);
 }
 
-static void requestComplete2(Request *request)
+static void renderRelease(const Frame &frame)
 {
-    if (request->status() == Request::RequestCancelled)
+	postToLoop(*releases, frame);
+}
+
+static void releaseFrame(const Frame &frame)
+{
+	unsigned int &holds = extra_holds[frame.source][frame.slot];
+	if (holds) {
+		holds--;
 		return;
-	loop.callLater(std::bind(&processRequest2, request));
+	}
+	sources[frame.source]->release(frame.slot);
 }
 
-static void processRequest(Request *request)
+static void processCompletions()
 {
-	//float framerate = 0;
-	//auto ts = request->metadata().get(controls::SensorTimestamp);
-	//uint64_t timestamp = ts ? *ts : request->buffers().begin()->second->metadata().timestamp;
-	//if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
-		//framerate = 0;
-	//else
-		//framerate = 1e9 / (timestamp - last_timestamp_);
-	//last_timestamp_ = timestamp;
-	
-	////if (framerate < 55)
-	//std::cout << "Cam1 fps: " << framerate << '\n';
-	
-	const Request::BufferMap &buffers = request->buffers();
-	for (auto bufferPair : buffers) {
-		const Stream *stream = bufferPair.first;
-		FrameBuffer *buffer = bufferPair.second;
-		StreamConfiguration const &cfg = stream->configuration();
-		int fd = buffer->planes()[0].fd.get();
-		
-		makeBuffer(fd, cfg, buffer, 1);
+	TRACE_SCOPE("processCompletions");
+	Frame frame;
+	if (trigger_requested) {
+		trigger_requested = 0;
+		if (pretrigger && !pretrigger->trigger())
+			std::cout << "Pre-trigger flush still running, trigger ignored" << std::endl;
+	}
+	while (releases->pop(frame))
+		releaseFrame(frame);
+	while (!render_backlog.empty() && render_thread->submit(render_backlog.front()))
+		render_backlog.pop_front();
+	while (completions->pop(frame)) {
+		// The first frame of a camera only sets where its sequence starts,
+		// and a sequence that goes back (a restart) isn't a loss.
+		uint32_t gap = frame.sequence - next_sequence[frame.source];
+		if (next_sequence[frame.source] != UINT32_MAX && gap < 0x80000000)
+			sensor_lost[frame.source] += gap;
+		next_sequence[frame.source] = frame.sequence + 1;
+
+		FrameTiming &timing = latency->timing(frame.source, frame.slot);
+		timing.dispatched = latencyNow();
+		timing.sensor = frame.timestamp;
+		// The recorder's writer copies the frame, and hands it back once done.
+		if (recorder && (!motion || moving_cameras) &&
+		    recorder->write(frame, sources[frame.source]->mappedBuffer(frame.buffer)))
+			extra_holds[frame.source][frame.slot]++;
+		if (mjpeg && mjpeg->encode(frame, sources[frame.source]->mappedBuffer(frame.buffer)))
+			extra_holds[frame.source][frame.slot]++;
+		if (pretrigger)
+			pretrigger->add(frame, sources[frame.source]->mappedBuffer(frame.buffer));
+		// As with the stereo stage, the hold is counted before any release
+		// can come back.
+		if (motion && motion->submit(frame, yuvImage(*frame.config, sources[frame.source]->mappedBuffer(frame.buffer))))
+			extra_holds[frame.source][frame.slot]++;
+		// Subscribers hand frames back from the loop, through releaseFrame().
+		if (publisher)
+			extra_holds[frame.source][frame.slot] += publisher->publish(frame);
+		frame_sync->add(frame);
 	}
-	
-	/* Re-queue the Request to the camera. */
-	
-	request->reuse(Request::ReuseBuffers);
-	cameras[0]->queueRequest(request);
 }
 
-static void processRequest2(Request *request)
-{	
-	const Request::BufferMap &buffers2 = request->buffers();
-	for (auto bufferPair : buffers2) {
-		const Stream *stream = bufferPair.first;
-		FrameBuffer *buffer2 = bufferPair.second;
-		StreamConfiguration const &cfg2 = stream->configuration();
-		int fd2 = buffer2->planes()[0].fd.get();
-		
-		makeBuffer(fd2, cfg2, buffer2, 2);
+// Counts and sizes given on the command line, which must be whole numbers
+// within [min, max]: std::stoi would let "-1" through as a huge unsigned.
+static unsigned int parseUnsigned(std::string const &value, const char *option,
+				  unsigned int min, unsigned int max)
+{
+	size_t end = 0;
+	unsigned long number = 0;
+	try {
+		number = std::stoul(value, &end);
+	} catch (std::exception const &) {
+		end = 0;
 	}
-	
-	/* Re-queue the Request to the camera. */
-	request->reuse(Request::ReuseBuffers);
-	cameras[1]->queueRequest(request);
+	if (value.empty() || end != value.size() || value.find('-') != std::string::npos ||
+	    number < min || number > max)
+		throw std::runtime_error(std::string("Invalid ") + option + ": " + value + ", must be " +
+					 std::to_string(min) + " to " + std::to_string(max));
+	return number;
 }
 
-void makeRequests(int i)
+// A comma separated list of camera indices, such as --record-cameras 0,2.
+static std::vector<unsigned int> parseCameraList(std::string const &list)
 {
-	auto free_buffers(frame_buffers[i]);
-	while (true)
+	std::vector<unsigned int> cameras;
+	std::stringstream stream(list);
+	std::string camera;
+	while (std::getline(stream, camera, ','))
 	{
-		for (StreamConfiguration &cfg : *configs[i])
-		{
-			Stream *stream = cfg.stream();
-			if (stream == configs[i]->at(0).stream())
-			{
-				if (free_buffers[stream].empty())
-				{
-
-					std::cout << "Requests created\n";
-					return;
-				}
-				std::unique_ptr<Request> request = cameras[i]->createRequest();
-				if (!request)
-					throw std::runtime_error("failed to make request");
-				requests[i].push_back(std::move(request));
-			}
-			else if (free_buffers[stream].empty())
-				throw std::runtime_error("concurrent streams need matching numbers of buffers");
-
-			FrameBuffer *buffer = free_buffers[stream].front();
-			free_buffers[stream].pop();
-			if (requests[i].back()->addBuffer(stream, buffer) < 0)
-				throw std::runtime_error("failed to add buffer to request");
+		size_t end = 0;
+		unsigned long index = 0;
+		try {
+			index = std::stoul(camera, &end);
+		} catch (std::exception const &) {
+			end = 0;
 		}
+		if (camera.empty() || end != camera.size())
+			throw std::runtime_error("Invalid camera index: " + camera);
+		cameras.push_back(index);
 	}
+	return cameras;
 }
 
-void configureCamera(int i, options& params)
+// Runs on the event loop, posted from the motion worker.
+static void motionChanged(unsigned int camera, bool moving, unsigned int tiles)
 {
-	std::string cameraId = cm->cameras()[i]->id();
-	cameras[i] = cm->get(cameraId);
-	cameras[i]->acquire();
-	std::cout << "Acquired Camera: " << cameras[i]->id() << '\n';
-
-	configs[i] = cameras[i]->generateConfiguration( { StreamRole::Viewfinder } );
-	
-	if (!configs[i])
-		std::cout << "failed to generate viewfinder configuration\n";
-	
-    StreamConfiguration &streamConfig = configs[i]->at(0);
-	std::cout << "Default viewfinder configuration is: " << streamConfig.toString() << std::endl;
-	
-	int val = cameras[i]->configure(configs[i].get());
-    if (val) {
-        std::cout << "CONFIGURATION FAILED!" << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
-	
-    Size size(1280, 960);
-	auto area = cameras[i]->properties().get(properties::PixelArrayActiveAreas);
-	if (params.width != 0 && params.height != 0) //width and height were input
-		size=Size(params.width, params.height);
-    else if (area)
+	if (moving)
 	{
-		// The idea here is that most sensors will have a 2x2 binned mode that
-		// we can pick up.
-		size = (*area)[0].size() / 2;
-		//size = size.boundedToAspectRatio(Size(params.width, params.height));
-		size.alignDownTo(2, 2); // YUV420 will want to be even
-		std::cout << "Viewfinder size chosen is " << size.toString() << std::endl;
+		std::cout << "Motion on camera " << camera << " (" << tiles << " tiles)" << std::endl;
+		if (!moving_cameras++ && pretrigger)
+			pretrigger->trigger();
 	}
-	
-	configs[i]->at(0).pixelFormat = libcamera::formats::YUV420;
-	configs[i]->at(0).size = size;
-	
-	configs[i]->at(0).bufferCount = params.buffer_count;
-	
-	configs[i]->validate();
-	std::cout << "Validated viewfinder configuration is: "
-		  << streamConfig.toString() << std::endl;
-		  
-	val = cameras[i]->configure(configs[i].get());
-	if (val) {
-		std::cout << "CONFIGURATION FAILED!" << std::endl;
-		//return EXIT_FAILURE;
+	else
+	{
+		std::cout << "Camera " << camera << " still" << std::endl;
+		moving_cameras--;
 	}
+}
 
-	/*
-	 * Once we have a validated configuration, we can apply it to the
-	 * Camera.
-	 */
-	cameras[i]->configure(configs[i].get());
-	
-	allocators[i] = new FrameBufferAllocator(cameras[i]);
-	for (StreamConfiguration &cfg : *configs[i]) {
-		Stream *stream = cfg.stream();
-		if (allocators[i]->allocate(stream) < 0)
-			std::cerr << "Can't allocate buffers" << std::endl;
-			
-		for (const std::unique_ptr<FrameBuffer> &buffer : allocators[i]->buffers(stream))
-		{
-			size_t buffer_size = 0;
-			for (unsigned j = 0; j < buffer->planes().size(); j++)
-			{
-				const FrameBuffer::Plane &plane = buffer->planes()[j];
-				buffer_size += plane.length;
-				
-				if (j == buffer->planes().size() -1 || plane.fd.get() != buffer->planes()[j+1].fd.get())
-				{
-					void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
-					mapped_buffers[i][buffer.get()].push_back(Span<uint8_t>(static_cast<uint8_t*>(memory), buffer_size));
-					buffer_size = 0;
-				}
-			}
-			frame_buffers[i][stream].push(buffer.get());
-		}
-		
+static void logFrameRate()
+{
+	static auto lastTime = std::chrono::high_resolution_clock::now();
+
+	// Counters are reset on every report, so this logs every 160 frame sets.
+	if (frame_sync->stats().matched < 160)
+		return;
+
+	auto currentTime = std::chrono::high_resolution_clock::now();
+	int elapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - lastTime).count();
+	float elapsedS = (float)elapsedMS / 1000;
+	lastTime = currentTime;
+
+	FrameSyncStats stats = frame_sync->stats(true);
+	RenderStats render = render_thread->stats(true);
+	printf("%llu frames over %.2fs (%.1ffps)! \n", (unsigned long long)stats.matched, elapsedS, stats.matched / elapsedS);
+	printf("%llu displayed over %.2fs (%.1ffps), %llu superseded before display, %llu sets held back\n",
+	       (unsigned long long)render.rendered, elapsedS, render.rendered / elapsedS,
+	       (unsigned long long)render.superseded, (unsigned long long)delayed_sets);
+	delayed_sets = 0;
+	uint64_t lost = 0;
+	for (uint64_t camera_lost : sensor_lost)
+		lost += camera_lost;
+	printf("%llu frames lost at the sensor since the start\n", (unsigned long long)lost);
+	printf("%llu dropped frames over %.2fs! \n", (unsigned long long)stats.released, elapsedS);
+	printf("frame set skew: mean %.1fus, max %.1fus\n", stats.skewSum / 1000.0 / stats.matched, stats.skewMax / 1000.0);
+}
 
-		size_t allocated = allocators[i]->buffers(cfg.stream()).size();
-		std::cout << "Allocated " << allocated << " buffers for stream" << std::endl;
+static void submitFrames(const std::vector<Frame> &set)
+{
+	// Releases are only handled at the top of processCompletions(), so the
+	// stereo thread can't hand the pair back before the hold is counted.
+	if (stereo && stereo->submit(set[0], yuvImage(*set[0].config, sources[0]->mappedBuffer(set[0].buffer)),
+				     set[1], yuvImage(*set[1].config, sources[1]->mappedBuffer(set[1].buffer))))
+	{
+		extra_holds[0][set[0].slot]++;
+		extra_holds[1][set[1].slot]++;
 	}
-	
-	makeRequests(i);
+	// Behind any set that is already waiting, so they are drawn in order.
+	if (!render_backlog.empty() || !render_thread->submit(set))
+	{
+		render_backlog.push_back(set);
+		delayed_sets++;
+	}
+	logFrameRate();
 }
 
 int main(int argc, char **argv)
 {
+	uint64_t launch = latencyNow();
 	options params = {
 		.dual_cameras = 1,
+		.num_cameras = 0, // all connected cameras
 		.width = 0, //default
 		.height = 0, //default
 		.prev_x = 0, 
@@ -245,11 +329,108 @@ int main(int argc, char **argv)
 		.exposure = "normal",
 		.exposure_index = cam_exposure_index,
 		.timeout = 10,
-		.buffer_count = 4
+		.buffer_count = 4,
+		.sync_tolerance_us = 0, // half a frame duration
+		.headless = false,
+		.readback = "",
+		.latency_interval = 0, // report at exit only
+		.synthetic = 0,
+		.jitter = "none",
+		.scanout = false,
+		.record = "",
+		.record_cameras = {}, // all cameras
+		.record_queue = 8,
+		.pretrigger = "",
+		.pretrigger_seconds = 5,
+		.cpu = false,
+		.stereo_scale = 0, // off
+		.stereo_disparities = 64,
+		.stereo_block = 7,
+		.motion_threshold = 0, // off
+		.motion_scale = 4,
+		.publish = "",
+		.publish_hold = 1,
+		.publish_timeout_ms = 500,
+		.layout = "grid",
+		.mailbox_depth = 1,
+		.mailbox_policy = "newest",
+		.mjpeg = "",
+		.mjpeg_quality = 85,
+		.mjpeg_threads = 0, // a share of the spare cores
+		.trace = ""
 	};
-			
+
+#ifdef SIMPLE_CAM_BENCH
+	// simple-cam-bench: two synthetic cameras rendered offscreen.
+	params.synthetic = 2;
+	params.headless = true;
+#endif
+
+	enum {
+		OptSyncTolerance = 256,
+		OptHeadless,
+		OptReadback,
+		OptLatencyInterval,
+		OptSynthetic,
+		OptJitter,
+		OptScanout,
+		OptRecord,
+		OptRecordCameras,
+		OptRecordQueue,
+		OptPretrigger,
+		OptPretriggerSeconds,
+		OptCpu,
+		OptStereo,
+		OptStereoDisparities,
+		OptStereoBlock,
+		OptMotion,
+		OptMotionScale,
+		OptPublish,
+		OptPublishHold,
+		OptPublishTimeout,
+		OptLayout,
+		OptMailboxDepth,
+		OptMailboxPolicy,
+		OptMjpeg,
+		OptMjpegQuality,
+		OptMjpegThreads,
+		OptTrace,
+	};
+
+	static const struct option long_options[] = {
+		{ "sync-tolerance", required_argument, nullptr, OptSyncTolerance },
+		{ "headless", no_argument, nullptr, OptHeadless },
+		{ "readback", required_argument, nullptr, OptReadback },
+		{ "latency-interval", required_argument, nullptr, OptLatencyInterval },
+		{ "synthetic", required_argument, nullptr, OptSynthetic },
+		{ "jitter", required_argument, nullptr, OptJitter },
+		{ "scanout", no_argument, nullptr, OptScanout },
+		{ "record", required_argument, nullptr, OptRecord },
+		{ "record-cameras", required_argument, nullptr, OptRecordCameras },
+		{ "record-queue", required_argument, nullptr, OptRecordQueue },
+		{ "pretrigger", required_argument, nullptr, OptPretrigger },
+		{ "pretrigger-seconds", required_argument, nullptr, OptPretriggerSeconds },
+		{ "cpu", no_argument, nullptr, OptCpu },
+		{ "stereo", required_argument, nullptr, OptStereo },
+		{ "stereo-disparities", required_argument, nullptr, OptStereoDisparities },
+		{ "stereo-block", required_argument, nullptr, OptStereoBlock },
+		{ "motion", required_argument, nullptr, OptMotion },
+		{ "motion-scale", required_argument, nullptr, OptMotionScale },
+		{ "publish", required_argument, nullptr, OptPublish },
+		{ "publish-hold", required_argument, nullptr, OptPublishHold },
+		{ "publish-timeout", required_argument, nullptr, OptPublishTimeout },
+		{ "layout", required_argument, nullptr, OptLayout },
+		{ "mailbox-depth", required_argument, nullptr, OptMailboxDepth },
+		{ "mailbox-policy", required_argument, nullptr, OptMailboxPolicy },
+		{ "mjpeg", required_argument, nullptr, OptMjpeg },
+		{ "mjpeg-quality", required_argument, nullptr, OptMjpegQuality },
+		{ "mjpeg-threads", required_argument, nullptr, OptMjpegThreads },
+		{ "trace", required_argument, nullptr, OptTrace },
+		{ nullptr, 0, nullptr, 0 },
+	};
+
 	int arg;
-	while ((arg = getopt(argc, argv, "r:w:h:p:f:s:e:t:b:")) != -1)
+	while ((arg = getopt_long(argc, argv, "r:w:h:p:f:s:e:t:b:n:", long_options, nullptr)) != -1)
 	{
 		switch (arg)
 		{
@@ -285,34 +466,227 @@ int main(int argc, char **argv)
 			case 'b':
 				params.buffer_count = std::stoi(optarg);
 				break;
+			case 'n':
+				params.num_cameras = std::stoi(optarg);
+				break;
+			case OptSyncTolerance:
+				params.sync_tolerance_us = std::stoi(optarg);
+				break;
+			case OptHeadless:
+				params.headless = true;
+				break;
+			case OptReadback:
+				params.readback = optarg;
+				break;
+			case OptLatencyInterval:
+				params.latency_interval = std::stoi(optarg);
+				break;
+			case OptSynthetic:
+				params.synthetic = std::stoi(optarg);
+				break;
+			case OptJitter:
+				params.jitter = optarg;
+				break;
+			case OptScanout:
+				params.scanout = true;
+				break;
+			case OptRecord:
+				params.record = optarg;
+				break;
+			case OptRecordCameras:
+				params.record_cameras = parseCameraList(optarg);
+				break;
+			case OptRecordQueue:
+				params.record_queue = std::stoi(optarg);
+				break;
+			case OptPretrigger:
+				params.pretrigger = optarg;
+				break;
+			case OptPretriggerSeconds:
+				params.pretrigger_seconds = std::stof(optarg);
+				break;
+			case OptCpu:
+				params.cpu = true;
+				break;
+			case OptStereo:
+				params.stereo_scale = parseUnsigned(optarg, "--stereo", 1, 16);
+				break;
+			case OptStereoDisparities:
+				params.stereo_disparities = parseUnsigned(optarg, "--stereo-disparities", 2, 256);
+				break;
+			case OptStereoBlock:
+				params.stereo_block = parseUnsigned(optarg, "--stereo-block", 1, 15);
+				break;
+			case OptMotion:
+				params.motion_threshold = std::stoi(optarg);
+				break;
+			case OptMotionScale:
+				params.motion_scale = std::stoi(optarg);
+				break;
+			case OptPublish:
+				params.publish = optarg;
+				break;
+			case OptPublishHold:
+				params.publish_hold = std::stoi(optarg);
+				break;
+			case OptPublishTimeout:
+				params.publish_timeout_ms = std::stoi(optarg);
+				break;
+			case OptLayout:
+				params.layout = optarg;
+				break;
+			case OptMailboxDepth:
+				params.mailbox_depth = std::stoi(optarg);
+				break;
+			case OptMailboxPolicy:
+				params.mailbox_policy = optarg;
+				break;
+			case OptMjpeg:
+				params.mjpeg = optarg;
+				break;
+			case OptMjpegQuality:
+				params.mjpeg_quality = std::stoi(optarg);
+				break;
+			case OptMjpegThreads:
+				params.mjpeg_threads = std::stoi(optarg);
+				break;
+			case OptTrace:
+				params.trace = optarg;
+				break;
 			default:
-				printf("Usage: %s [-d dual cameras] [-w width] [-h height] [-p x,y,width,height][-f fps] [-s shutter-speed-ns] [-e exposure] [-t timeout] \n", argv[0]);
+				printf("Usage: %s [-d dual cameras] [-w width] [-h height] [-p x,y,width,height][-f fps] [-s shutter-speed-ns] [-e exposure] [-t timeout] [-n cameras] [--sync-tolerance us] [--headless [--readback file.ppm]] [--latency-interval sec] [--synthetic cameras [--jitter none|uniform:us|burst:n]] [--scanout] [--record prefix [--record-cameras 0,1] [--record-queue frames]] [--pretrigger prefix [--pretrigger-seconds sec]] [--cpu] [--stereo downscale [--stereo-disparities n] [--stereo-block size]] [--motion threshold [--motion-scale n]] [--publish socket [--publish-hold frames] [--publish-timeout ms]] [--layout grid|side|pip] [--mailbox-depth frames] [--mailbox-policy newest|block] [--mjpeg prefix [--mjpeg-quality q] [--mjpeg-threads n]] [--trace file.json] \n", argv[0]);
 				break;
 		}
 	}
 	
 	if (arg < 1)
-		printf("Usage: %s [-d dual cameras] [-w width] [-h height] [-p width,height,x_off,y_off][-f fps] [-s shutter-speed-ns] [-e exposure] [-t timeout] \n", argv[0]);
-	
-	// Initialize the camera Manager
-	cm = std::make_unique<CameraManager>();
-	cm->start();
-
-	// Ensure that cameras are connected
-	if (cm->cameras().empty()) {
-		std::cout << "No cameras were identified on the system."
-			  << std::endl;
-		cm->stop();
-		return EXIT_FAILURE;
+		printf("Usage: %s [-d dual cameras] [-w width] [-h height] [-p width,height,x_off,y_off][-f fps] [-s shutter-speed-ns] [-e exposure] [-t timeout] [-n cameras] [--sync-tolerance us] [--headless [--readback file.ppm]] [--latency-interval sec] [--synthetic cameras [--jitter none|uniform:us|burst:n]] [--scanout] [--record prefix [--record-cameras 0,1] [--record-queue frames]] [--pretrigger prefix [--pretrigger-seconds sec]] [--cpu] [--stereo downscale [--stereo-disparities n] [--stereo-block size]] [--motion threshold [--motion-scale n]] [--publish socket [--publish-hold frames] [--publish-timeout ms]] [--layout grid|side|pip] [--mailbox-depth frames] [--mailbox-policy newest|block] [--mjpeg prefix [--mjpeg-quality q] [--mjpeg-threads n]] [--trace file.json] \n", argv[0]);
+
+	options_ = std::make_unique<options>(params);
+
+	if (!params.trace.empty())
+	{
+#ifdef SIMPLE_CAM_TRACE
+		// 8MB for each thread that records, minutes of frames.
+		traceStart(1 << 18);
+		TRACE_THREAD("event loop");
+#else
+		std::cout << "Built without SIMPLE_CAM_TRACE, --trace ignored" << std::endl;
+#endif
 	}
 	
-	// Setup each camera
-	for (int i = 0; i < 2; i++) {
-		configureCamera(i, params);
+	/*
+	 * The display and EGL come up on their own thread while the cameras
+	 * are found, configured and given their buffers, which is where most
+	 * of the time to the first frame goes.
+	 */
+	// Taken as soon as the display is up: startup only exists once the
+	// cameras are counted, and the join below waits for them too.
+	std::exception_ptr display_error;
+	uint64_t display_ready = 0;
+	std::thread display_init([&]() {
+		try {
+			makeWindow("simple-cam", params.prev_x, params.prev_y, params.prev_width, params.prev_height, params.headless);
+			display_ready = latencyNow();
+			setReadback(params.readback);
+		} catch (...) {
+			display_error = std::current_exception();
+		}
+	});
+
+	unsigned int num_cameras;
+	if (params.synthetic)
+	{
+		// No hardware: frames come from generators running at -f fps.
+		num_cameras = params.synthetic;
+		startup = std::make_unique<StartupTrace>(num_cameras, launch);
+		for (unsigned int i = 0; i < num_cameras; i++) {
+			sources.push_back(std::make_unique<SyntheticSource>(i, params.fps, params.jitter));
+			startup->mark(i, StartupTrace::Acquired);
+		}
 	}
-	
-	cameras[0]->requestCompleted.connect(requestComplete);
-	cameras[1]->requestCompleted.connect(requestComplete2);
+	else
+	{
+		// Initialize the camera Manager
+		cm = std::make_unique<CameraManager>();
+		cm->start();
+
+		// Ensure that cameras are connected
+		if (cm->cameras().empty()) {
+			std::cout << "No cameras were identified on the system."
+				  << std::endl;
+			cm->stop();
+			display_init.join();
+			return EXIT_FAILURE;
+		}
+
+		num_cameras = cm->cameras().size();
+		if (params.num_cameras && params.num_cameras < num_cameras)
+			num_cameras = params.num_cameras;
+
+		startup = std::make_unique<StartupTrace>(num_cameras, launch);
+		sources.resize(num_cameras);
+	}
+
+	// Setup each camera, all at once: configure() mostly waits on the
+	// sensor and the buffer allocations.
+	std::vector<std::exception_ptr> camera_errors(num_cameras);
+	std::vector<std::thread> camera_init;
+	for (unsigned int i = 0; i < num_cameras; i++) {
+		camera_init.emplace_back([&, i]() {
+			try {
+				if (!sources[i]) {
+					sources[i] = std::make_unique<CameraPipeline>(i, cm->cameras()[i]);
+					startup->mark(i, StartupTrace::Acquired);
+				}
+				sources[i]->setStartupTrace(startup.get());
+				sources[i]->configure(params.width, params.height, params.buffer_count);
+			} catch (...) {
+				camera_errors[i] = std::current_exception();
+			}
+		});
+	}
+	for (std::thread &thread : camera_init)
+		thread.join();
+	display_init.join();
+	for (std::exception_ptr &error : camera_errors) {
+		if (error)
+			std::rethrow_exception(error);
+	}
+	if (display_error)
+		std::rethrow_exception(display_error);
+	startup->markDisplay(display_ready);
+
+	size_t total_slots = 0;
+	std::vector<size_t> slots_per_camera;
+	// What the recorder and pre-trigger rings size their storage from.
+	std::vector<StreamConfiguration> stream_configs;
+	for (auto &source : sources) {
+		source->onComplete(frameComplete);
+		total_slots += source->slots();
+		slots_per_camera.push_back(source->slots());
+		stream_configs.push_back(source->streamConfiguration());
+		extra_holds.emplace_back(source->slots(), 0);
+		// EGL and KMS would fail to import them on the render thread.
+		if (!source->dmabuf() && (!params.cpu || params.scanout))
+		{
+			std::cout << "Frame buffers are not dmabufs, drawing on the CPU" << std::endl;
+			params.cpu = true;
+			params.scanout = false;
+		}
+	}
+	next_sequence.assign(num_cameras, UINT32_MAX);
+	sensor_lost.assign(num_cameras, 0);
+
+	latency = std::make_unique<LatencyTracker>(slots_per_camera);
+	if (params.latency_interval)
+		loop.addTimer(params.latency_interval, []() { latency->report("Interval", true); });
+
+	completions = std::make_unique<CompletionQueue<Frame>>(total_slots);
+	// A frame shared with the stereo and motion stages, the recorder and the
+	// MJPEG encoder is released by each.
+	releases = std::make_unique<CompletionQueue<Frame>>(total_slots * 5);
+	loop.onWakeup(processCompletions);
 	
 	ControlList controls;
 	
@@ -332,6 +706,115 @@ int main(int argc, char **argv)
 	controls.set(controls::AeExposureMode, cam_exposure_index);
 	controls.set(controls::ExposureTime, params.shutterSpeed);
 	controls.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+
+	// Frames from all sensors are grouped when their timestamps are within
+	// the tolerance, which defaults to half a frame.
+	uint64_t tolerance_ns = params.sync_tolerance_us ? params.sync_tolerance_us * 1000ULL : frame_time * 500ULL;
+	frame_sync = std::make_unique<FrameSync>(num_cameras, tolerance_ns);
+	frame_sync->onMatch(submitFrames);
+	frame_sync->onRelease(releaseFrame);
+
+	render_thread = std::make_unique<RenderThread>(num_cameras, params.prev_width, params.prev_height);
+	render_thread->onRelease(renderRelease);
+	render_thread->onSpace([]() { loop.wakeup(); });
+	render_thread->setLatencyTracker(latency.get());
+	render_thread->setStartupTrace(startup.get());
+	startup->onComplete([]() { loop.callLater([]() { startup->report(); }); });
+	// Also the fallback when EGL can't import the camera buffers.
+	render_thread->onMapping([](const Frame &frame) -> std::vector<Span<uint8_t>> const & {
+		return sources[frame.source]->mappedBuffer(frame.buffer);
+	});
+	render_thread->setCpu(params.cpu);
+
+	bool use_stereo = params.stereo_scale && num_cameras >= 2;
+	// The disparity map only has a cell in the GL preview.
+	if (use_stereo && (params.cpu || params.scanout))
+		throw std::runtime_error("--stereo needs the GL preview, not --cpu, --scanout or non-dmabuf buffers");
+
+	// The CPU compositor, the stereo matcher and the MJPEG encoder each run
+	// their own threads. Split the cores left after the event loop and the
+	// render thread between those in use, rather than each taking them all.
+	unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+	unsigned int spare_cpus = cpus > 2 ? cpus - 2 : 1;
+	unsigned int cpu_stages = params.cpu + use_stereo + (!params.mjpeg.empty() && !params.mjpeg_threads);
+	unsigned int stage_cpus = std::max(1u, spare_cpus / std::max(1u, cpu_stages));
+	// Counted with the render thread, which draws a band too. A fallback to
+	// the CPU after an EGL import failure gets the same share.
+	render_thread->setCpuThreads(stage_cpus + 1);
+	if (params.mailbox_policy != "newest" && params.mailbox_policy != "block")
+		throw std::runtime_error("Invalid mailbox policy: " + params.mailbox_policy);
+	render_thread->setMailbox(params.mailbox_depth,
+				  params.mailbox_policy == "block" ? MailboxPolicy::Block : MailboxPolicy::Newest);
+
+	std::map<std::string, PreviewLayout> layouts =
+		{ { "grid", PreviewLayout::Grid },
+		  { "side", PreviewLayout::SideBySide },
+		  { "pip", PreviewLayout::PictureInPicture } };
+	if (layouts.count(params.layout) == 0)
+		throw std::runtime_error("Invalid layout: " + params.layout);
+	setPreviewLayout(layouts[params.layout]);
+
+	if (use_stereo)
+	{
+		// Cameras 0 and 1 are the left and right of a rectified pair.
+		stereo = std::make_unique<StereoDepth>(params.stereo_scale, params.stereo_disparities, params.stereo_block,
+						       stage_cpus);
+		stereo->onRelease(renderRelease);
+		stereo->onResult([](std::vector<uint8_t> const &map, unsigned int width, unsigned int height) {
+			render_thread->showAux(map, width, height);
+		});
+		stereo->start();
+	}
+
+	if (params.motion_threshold)
+	{
+		motion = std::make_unique<MotionDetector>(num_cameras, params.fps, params.motion_scale, params.motion_threshold);
+		motion->onRelease(renderRelease);
+		motion->onTrigger([](unsigned int camera, bool moving, unsigned int tiles) {
+			loop.callLater([=]() { motionChanged(camera, moving, tiles); });
+		});
+		motion->start();
+	}
+
+	if (!params.publish.empty())
+	{
+		publisher = std::make_unique<FramePublisher>(loop, params.publish, num_cameras,
+							     params.publish_hold, params.publish_timeout_ms);
+		publisher->onRelease(releaseFrame);
+	}
+
+	if (!params.record.empty())
+	{
+		std::vector<unsigned int> record_cameras = params.record_cameras;
+		for (unsigned int camera : record_cameras)
+		{
+			if (camera >= num_cameras)
+				throw std::runtime_error("Invalid camera in --record-cameras: " + std::to_string(camera) +
+							 ", there are " + std::to_string(num_cameras));
+		}
+		if (params.record_cameras.empty())
+		{
+			for (unsigned int i = 0; i < num_cameras; i++)
+				record_cameras.push_back(i);
+		}
+		recorder = std::make_unique<RawRecorder>(params.record, record_cameras, stream_configs, params.record_queue);
+		recorder->onRelease(renderRelease);
+		recorder->start();
+	}
+
+	if (!params.mjpeg.empty())
+	{
+		mjpeg = std::make_unique<MjpegEncoder>(params.mjpeg, stream_configs, params.fps,
+						       params.mjpeg_quality, params.mjpeg_threads ? params.mjpeg_threads : stage_cpus);
+		mjpeg->onRelease(renderRelease);
+		mjpeg->start();
+	}
+
+	if (!params.pretrigger.empty())
+	{
+		pretrigger = std::make_unique<PretriggerRing>(params.pretrigger, stream_configs, params.pretrigger_seconds, params.fps);
+		signal(SIGUSR1, triggerSignal);
+	}
 	
 	//if (!controls.get(controls::Brightness)) // Adjust the brightness of the output images, in the range -1.0 to 1.0
 	//	controls.set(controls::Brightness, 0.0);
@@ -341,29 +824,142 @@ int main(int argc, char **argv)
     // Set the exposure time
     //controls.set(controls::ExposureTime, frame_time);
     
-    for (int i = 0; i < 2; i++) {
-		cameras[i]->start(&controls);
-		for (std::unique_ptr<Request> &request : requests[i])
-			cameras[i]->queueRequest(request.get());
+	for (unsigned int i = 0; i < num_cameras; i++) {
+		sources[i]->start(controls);
+		startup->mark(i, StartupTrace::Started);
 	}
-		
-	// Setup EGL context
-	makeWindow("simple-cam", params.prev_x, params.prev_y, params.prev_width, params.prev_height);
 
-	loop.timeout(params.timeout);
-	int ret = loop.exec(params.prev_width, params.prev_height, params.timeout);
+	// Atomic page flip completions are delivered on the DRM fd.
+	if (displayEventFd() >= 0)
+		loop.addWatch(displayEventFd(), handleDisplayEvents);
+	// Each camera keeps up to two buffers on its plane, so this wants -b 4 or more.
+	if (params.scanout)
+		render_thread->setScanout(setupScanout(num_cameras));
+	render_thread->start();
+
+	if (params.timeout > 0)
+		loop.timeout(params.timeout);
+	auto run_start = std::chrono::steady_clock::now();
+	int ret = loop.exec();
+	render_thread->stop();
+	for (std::vector<Frame> &set : render_backlog)
+	{
+		for (Frame &frame : set)
+		{
+			if (frame.buffer)
+				releaseFrame(frame);
+		}
+	}
+	render_backlog.clear();
+	if (stereo)
+		stereo->stop();
+	if (motion)
+		motion->stop();
+	if (publisher)
+		publisher->stop();
+	if (recorder)
+		recorder->stop();
+	if (mjpeg)
+		mjpeg->stop();
+#ifdef SIMPLE_CAM_TRACE
+	if (!params.trace.empty())
+	{
+		if (traceDump(params.trace))
+			std::cout << "Trace written to " << params.trace << std::endl;
+		else
+			std::cerr << "failed to write " << params.trace << std::endl;
+	}
+#endif
+	double run_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
 	std::cout << "Capture ran for " << params.timeout << " seconds and "
 		  << "stopped with exit status: " << ret << std::endl;
+	printf("Rendered %llu frames in %.2fs (%.1ffps)\n", (unsigned long long)render_thread->totalRendered(),
+	       run_time, render_thread->totalRendered() / run_time);
+
+	latency->report(params.latency_interval ? "Final interval" : "Session", false);
+	// Reported already once every camera showed a frame.
+	if (!startup->complete())
+		startup->report();
 
+	for (auto &source : sources)
+		source->report();
 
-	for (int i = 0; i < 2; i++) {
-		cameras[i]->stop();
-		delete allocators[i];
-		cameras[i]->release();
-		cameras[i].reset();
-		requests[i].clear();
+	if (completion_overflows)
+		std::cout << completion_overflows << " completions lost to a full queue" << std::endl;
+
+	for (unsigned int i = 0; i < num_cameras; i++)
+	{
+		if (sensor_lost[i])
+			std::cout << "Camera " << i << ": " << sensor_lost[i] << " frames lost at the sensor" << std::endl;
 	}
-    cm->stop();
+
+	if (recorder)
+	{
+		RecorderStats recorded = recorder->stats();
+		printf("Recorded %llu frames (%.1fMB), %llu dropped with the writer behind, %llu failed\n",
+		       (unsigned long long)recorded.written, recorded.bytes / 1e6,
+		       (unsigned long long)recorded.dropped, (unsigned long long)recorded.failed);
+		recorder.reset();
+	}
+
+	if (mjpeg)
+	{
+		EncoderStats encoded = mjpeg->stats();
+		printf("MJPEG: %llu frames (%.1fMB, %.1f frames/s) on %u threads, %llu dropped with the encoders behind, "
+		       "%llu failed, %llu gaps filled, peak queue %u\n",
+		       (unsigned long long)encoded.encoded, encoded.bytes / 1e6, encoded.encoded / run_time,
+		       mjpeg->threads(), (unsigned long long)encoded.dropped, (unsigned long long)encoded.failed,
+		       (unsigned long long)encoded.filled, encoded.peakDepth);
+		printf("MJPEG latency: queued p50 %lluus p99 %lluus, encode p50 %lluus p99 %lluus, to disk p50 %lluus p99 %lluus\n",
+		       (unsigned long long)encoded.wait.p50, (unsigned long long)encoded.wait.p99,
+		       (unsigned long long)encoded.encode.p50, (unsigned long long)encoded.encode.p99,
+		       (unsigned long long)encoded.total.p50, (unsigned long long)encoded.total.p99);
+		mjpeg.reset();
+	}
+
+	if (stereo)
+	{
+		StereoStats depth = stereo->stats();
+		printf("Stereo: %llu disparity maps, %.1fms each, %llu pairs skipped while busy\n",
+		       (unsigned long long)depth.computed, depth.computed ? depth.costUs / 1000.0 / depth.computed : 0.0,
+		       (unsigned long long)depth.skipped);
+	}
+
+	if (motion)
+	{
+		MotionStats detected = motion->stats();
+		printf("Motion: %llu frames compared (p50 %lluus, p99 %lluus), %llu passed over under load\n",
+		       (unsigned long long)detected.processed, (unsigned long long)detected.cost.p50,
+		       (unsigned long long)detected.cost.p99, (unsigned long long)detected.skipped);
+	}
+
+	if (publisher)
+	{
+		PublisherStats published = publisher->stats();
+		printf("Published %llu frames, %llu skipped for busy subscribers, %llu subscribers dropped\n",
+		       (unsigned long long)published.sent, (unsigned long long)published.skipped,
+		       (unsigned long long)published.dropped);
+		publisher.reset();
+	}
+
+	if (pretrigger)
+	{
+		if (pretrigger->missed())
+			std::cout << pretrigger->missed() << " frames not kept while pre-trigger rings were flushing" << std::endl;
+		// Waits for a flush still in progress.
+		pretrigger.reset();
+	}
+
+	ImageCacheStats cache = imageCacheStats();
+	std::cout << "EGLImage cache: " << cache.hits << " hits, "
+		  << cache.misses << " misses" << std::endl;
+
+
+	for (auto &source : sources)
+		source->stop();
+	sources.clear();
+	if (cm)
+		cm->stop();
 	cleanup();
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * startup_trace.cpp - Per-camera bring-up timestamps
+ */
+
+#include "startup_trace.h"
+#include "latency.h"
+
+#include <stdio.h>
+
+StartupTrace::StartupTrace(unsigned int cameras, uint64_t origin)
+	: cameras_(cameras), origin_(origin), times_(new std::atomic<uint64_t>[cameras * StepCount]),
+	  display_(0), remaining_(cameras)
+{
+	for (unsigned int i = 0; i < cameras * StepCount; i++)
+		times_[i] = 0;
+}
+
+void StartupTrace::set(unsigned int camera, Step step)
+{
+	uint64_t expected = 0;
+	/* A step is never marked at the origin itself, 0 means unset. */
+	uint64_t now = latencyNow() | 1;
+	if (!times_[camera * StepCount + step].compare_exchange_strong(expected, now))
+		return;
+
+	if (step == FirstDisplayed && remaining_.fetch_sub(1) == 1 && complete_)
+		complete_();
+}
+
+void StartupTrace::markDisplay(uint64_t time)
+{
+	display_ = time;
+}
+
+void StartupTrace::report()
+{
+	static const char *names[StepCount] = {
+		"acquired", "configured", "allocated", "started", "first frame", "first shown",
+	};
+
+	auto ms = [this](uint64_t time) { return (time - origin_) / 1e6; };
+
+	printf("Startup (ms since launch):\n");
+	if (display_)
+		printf("  display ready %.1f\n", ms(display_));
+	for (unsigned int i = 0; i < cameras_; i++) {
+		printf("  camera %u:", i);
+		for (unsigned int step = 0; step < StepCount; step++) {
+			uint64_t time = times_[i * StepCount + step].load();
+			if (time)
+				printf(" %s %.1f", names[step], ms(time));
+			else
+				printf(" %s -", names[step]);
+			printf(step + 1 < StepCount ? "," : "\n");
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+/*
+ * When each camera got through each step of bring-up, for time-to-first-frame
+ * measurements. Times are taken with latencyNow() and reported relative to
+ * the given origin, which should be taken as early in main() as possible.
+ * Only the first mark() of a camera and step counts, so the per-frame steps
+ * can be marked on every frame at the cost of one load. mark() is lock-free
+ * and safe from any thread.
+ */
+class StartupTrace
+{
+public:
+	enum Step {
+		Acquired,
+		Configured,
+		Allocated,
+		Started,
+		FirstCompleted,
+		FirstDisplayed,
+		StepCount,
+	};
+
+	/* Called once every camera has displayed a frame, from that thread. */
+	using CompleteHandler = std::function<void()>;
+
+	StartupTrace(unsigned int cameras, uint64_t origin);
+
+	void onComplete(const CompleteHandler &handler) { complete_ = handler; }
+
+	void mark(unsigned int camera, Step step)
+	{
+		if (!times_[camera * StepCount + step].load(std::memory_order_relaxed))
+			set(camera, step);
+	}
+	/* The display and EGL were ready at this latencyNow() time. */
+	void markDisplay(uint64_t time);
+
+	bool complete() const { return remaining_.load() == 0; }
+	void report();
+
+private:
+	void set(unsigned int camera, Step step);
+
+	unsigned int cameras_;
+	uint64_t origin_;
+	std::unique_ptr<std::atomic<uint64_t>[]> times_;
+	std::atomic<uint64_t> display_;
+	std::atomic<unsigned int> remaining_; // cameras yet to display a frame
+	CompleteHandler complete_;
+};
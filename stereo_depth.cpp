@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * stereo_depth.cpp - Block matching disparity on a camera pair
+ */
+
+#include "stereo_depth.h"
+#include "latency.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * sum[i] += |a[i] - b[i]|, or -= when subtract is set. This is the inner loop
+ * of the whole search, run twice per row and disparity. SSE2 and NEON are
+ * baseline on the 64-bit targets we build for, so there is no dispatch.
+ */
+static void accumulateAbsDiff(const uint8_t *a, const uint8_t *b, uint16_t *sum, unsigned int n, bool subtract)
+{
+	unsigned int i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+		__m128i *out = reinterpret_cast<__m128i *>(sum + i);
+		__m128i lo = _mm_loadu_si128(out);
+		__m128i hi = _mm_loadu_si128(out + 1);
+		if (subtract) {
+			lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(diff, zero));
+			hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(diff, zero));
+		} else {
+			lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(diff, zero));
+			hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(diff, zero));
+		}
+		_mm_storeu_si128(out, lo);
+		_mm_storeu_si128(out + 1, hi);
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t diff = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+		uint16x8_t lo = vld1q_u16(sum + i);
+		uint16x8_t hi = vld1q_u16(sum + i + 8);
+		if (subtract) {
+			lo = vsubw_u8(lo, vget_low_u8(diff));
+			hi = vsubw_u8(hi, vget_high_u8(diff));
+		} else {
+			lo = vaddw_u8(lo, vget_low_u8(diff));
+			hi = vaddw_u8(hi, vget_high_u8(diff));
+		}
+		vst1q_u16(sum + i, lo);
+		vst1q_u16(sum + i + 8, hi);
+	}
+#endif
+	for (; i < n; i++) {
+		int diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+		sum[i] = subtract ? sum[i] - diff : sum[i] + diff;
+	}
+}
+
+StereoDepth::StereoDepth(unsigned int scale, unsigned int disparities, unsigned int block, unsigned int threads)
+	: scale_(std::max(1u, scale)), disparities_(std::min(256u, std::max(2u, disparities))), radius_(block / 2),
+	  stopping_(false), pending_(false), frames_{}, images_{}, width_(0), height_(0),
+	  computed_(0), skipped_(0), costUs_(0)
+{
+	/* Block sums of up to 15x15 differences fit the 16-bit accumulators. */
+	if (block > 15 || !(block & 1))
+		throw std::runtime_error("stereo block size must be odd and at most 15");
+
+	pool_ = std::make_unique<ThreadPool>(std::max(1u, threads));
+}
+
+StereoDepth::~StereoDepth()
+{
+	stop();
+}
+
+void StereoDepth::start()
+{
+	stopping_ = false;
+	thread_ = std::thread(&StereoDepth::run, this);
+}
+
+void StereoDepth::stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+
+	/* A pair that was never picked up still has to go back. */
+	if (pending_) {
+		release_(frames_[0]);
+		release_(frames_[1]);
+		pending_ = false;
+	}
+}
+
+bool StereoDepth::submit(const Frame &left, const YuvImage &leftImage, const Frame &right, const YuvImage &rightImage)
+{
+	if (!leftImage.y || !rightImage.y)
+		return false;
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		if (pending_) {
+			skipped_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		frames_[0] = left;
+		frames_[1] = right;
+		images_[0] = leftImage;
+		images_[1] = rightImage;
+		pending_ = true;
+	}
+	cond_.notify_one();
+	return true;
+}
+
+StereoStats StereoDepth::stats(bool reset)
+{
+	if (reset)
+		return { computed_.exchange(0), skipped_.exchange(0), costUs_.exchange(0) };
+	return { computed_.load(), skipped_.load(), costUs_.load() };
+}
+
+void StereoDepth::run()
+{
+	std::unique_lock<std::mutex> locker(lock_);
+
+	while (true) {
+		cond_.wait(locker, [this]() { return stopping_ || pending_; });
+		if (stopping_)
+			break;
+
+		/* pending_ stays set, refusing new pairs, until the map is out. */
+		locker.unlock();
+		uint64_t start = latencyNow();
+
+		/* Both cameras are the same size, the right one is not checked. */
+		unsigned int width = images_[0].width / scale_;
+		unsigned int height = images_[0].height / scale_;
+		if (width != width_ || height != height_) {
+			width_ = width;
+			height_ = height;
+			left_.resize(width_ * height_);
+			right_.resize(width_ * height_);
+			map_.resize(width_ * height_);
+		}
+
+		unsigned int bands = std::min(height_, pool_->size() * 4);
+		pool_->parallelFor(bands * 2, [this, bands](unsigned int job) {
+			unsigned int band = job / 2;
+			downscale(images_[job & 1], job & 1 ? right_ : left_,
+				  height_ * band / bands, height_ * (band + 1) / bands);
+		});
+
+		/* Done with the camera buffers, the rest works on the copies. */
+		release_(frames_[0]);
+		release_(frames_[1]);
+
+		pool_->parallelFor(bands, [this, bands](unsigned int band) {
+			match(height_ * band / bands, height_ * (band + 1) / bands);
+		});
+
+		if (result_)
+			result_(map_, width_, height_);
+
+		costUs_.fetch_add((latencyNow() - start) / 1000, std::memory_order_relaxed);
+		computed_.fetch_add(1, std::memory_order_relaxed);
+
+		locker.lock();
+		pending_ = false;
+	}
+}
+
+/* Box filter rows [top, bottom) of the scaled down luma plane. */
+void StereoDepth::downscale(const YuvImage &image, std::vector<uint8_t> &out, unsigned int top, unsigned int bottom)
+{
+	thread_local std::vector<uint32_t> sums;
+	sums.resize(width_);
+	unsigned int area = scale_ * scale_;
+
+	for (unsigned int y = top; y < bottom; y++) {
+		std::fill(sums.begin(), sums.end(), 0);
+		for (unsigned int j = 0; j < scale_; j++) {
+			const uint8_t *row = image.y + (size_t)(y * scale_ + j) * image.stride;
+			for (unsigned int x = 0; x < width_; x++) {
+				for (unsigned int i = 0; i < scale_; i++)
+					sums[x] += row[x * scale_ + i];
+			}
+		}
+
+		uint8_t *dst = &out[(size_t)y * width_];
+		for (unsigned int x = 0; x < width_; x++)
+			dst[x] = sums[x] / area;
+	}
+}
+
+/*
+ * Winner takes all over the disparity range for rows [top, bottom). For each
+ * disparity the per-column block sums slide down the band, adding the row
+ * that enters the window and taking off the one that leaves, and a running
+ * sum across them gives every pixel's block cost.
+ */
+void StereoDepth::match(unsigned int top, unsigned int bottom)
+{
+	thread_local std::vector<uint16_t> columns;
+	thread_local std::vector<uint16_t> best;
+	thread_local std::vector<uint8_t> disparity;
+
+	unsigned int width = width_;
+	unsigned int rows = bottom - top;
+	int r = radius_;
+	columns.resize(width);
+	best.assign((size_t)rows * width, UINT16_MAX);
+	disparity.assign((size_t)rows * width, 0);
+
+	auto row = [this](const std::vector<uint8_t> &image, int y) {
+		y = std::min(std::max(y, 0), (int)height_ - 1);
+		return &image[(size_t)y * width_];
+	};
+
+	for (unsigned int d = 0; d < disparities_ && d + 2 * r + 1 <= width; d++) {
+		/* Left pixel x is compared with right pixel x - d. */
+		unsigned int n = width - d;
+		std::fill(columns.begin(), columns.end(), 0);
+		for (int j = -r; j <= r; j++)
+			accumulateAbsDiff(row(left_, (int)top + j) + d, row(right_, (int)top + j), &columns[d], n, false);
+
+		for (unsigned int y = top; y < bottom; y++) {
+			if (y > top) {
+				accumulateAbsDiff(row(left_, (int)y + r) + d, row(right_, (int)y + r), &columns[d], n, false);
+				accumulateAbsDiff(row(left_, (int)y - r - 1) + d, row(right_, (int)y - r - 1), &columns[d], n, true);
+			}
+
+			uint16_t *bestRow = &best[(size_t)(y - top) * width];
+			uint8_t *disparityRow = &disparity[(size_t)(y - top) * width];
+			unsigned int cost = 0;
+			for (int i = -r; i <= r; i++)
+				cost += columns[d + r + i];
+
+			for (unsigned int x = d + r; x + r < width; x++) {
+				if (x > d + r)
+					cost += columns[x + r] - columns[x - r - 1];
+				if (cost < bestRow[x]) {
+					bestRow[x] = cost;
+					disparityRow[x] = d;
+				}
+			}
+		}
+	}
+
+	unsigned int range = disparities_ - 1;
+	for (unsigned int y = top; y < bottom; y++) {
+		const uint8_t *src = &disparity[(size_t)(y - top) * width];
+		uint8_t *dst = &map_[(size_t)y * width];
+		for (unsigned int x = 0; x < width; x++)
+			dst[x] = src[x] * 255 / range;
+	}
+}
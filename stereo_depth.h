@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+#include "thread_pool.h"
+#include "yuv_convert.h"
+
+struct StereoStats
+{
+	uint64_t computed; // disparity maps produced
+	uint64_t skipped;  // frame pairs offered while still busy with the last
+	uint64_t costUs;   // total time spent on the maps computed
+};
+
+/*
+ * Block matching disparity between the luma planes of a rectified camera
+ * pair, left camera first. Each pair is box-downscaled straight from the
+ * mapped buffers, which go back through the release handler as soon as
+ * that is done. The sum of absolute differences over a square block is
+ * then searched over the disparity range, in row bands across a pool of
+ * workers. The result is a grey image, nearer being brighter, handed to the
+ * result handler from the stereo thread.
+ *
+ * submit() never waits: if the last pair is still being worked on, the new
+ * one is refused and stays with the caller.
+ */
+class StereoDepth
+{
+public:
+	using ReleaseHandler = std::function<void(const Frame &)>;
+	using ResultHandler = std::function<void(std::vector<uint8_t> const &map, unsigned int width, unsigned int height)>;
+
+	/*
+	 * Block is the matching window size, odd and at most 15. Threads is how
+	 * many cores the matching may use, the stereo thread included.
+	 */
+	StereoDepth(unsigned int scale, unsigned int disparities, unsigned int block, unsigned int threads);
+	~StereoDepth();
+
+	void onRelease(const ReleaseHandler &handler) { release_ = handler; }
+	void onResult(const ResultHandler &handler) { result_ = handler; }
+
+	void start();
+	void stop();
+
+	/* Called from the event loop. Returns false if the pair was refused. */
+	bool submit(const Frame &left, const YuvImage &leftImage, const Frame &right, const YuvImage &rightImage);
+
+	StereoStats stats(bool reset = false);
+
+private:
+	void run();
+	void downscale(const YuvImage &image, std::vector<uint8_t> &out, unsigned int top, unsigned int bottom);
+	void match(unsigned int top, unsigned int bottom);
+
+	unsigned int scale_;
+	unsigned int disparities_;
+	unsigned int radius_;
+
+	std::unique_ptr<ThreadPool> pool_;
+	std::thread thread_;
+	std::mutex lock_;
+	std::condition_variable cond_;
+	bool stopping_;
+	bool pending_;
+
+	Frame frames_[2];
+	YuvImage images_[2];
+
+	unsigned int width_;
+	unsigned int height_;
+	std::vector<uint8_t> left_;
+	std::vector<uint8_t> right_;
+	std::vector<uint8_t> map_;
+
+	ReleaseHandler release_;
+	ResultHandler result_;
+
+	std::atomic<uint64_t> computed_;
+	std::atomic<uint64_t> skipped_;
+	std::atomic<uint64_t> costUs_;
+};
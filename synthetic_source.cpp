@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * synthetic_source.cpp - Camera-free frame generator for benchmarks
+ */
+
+#include "synthetic_source.h"
+#include "latency.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <linux/udmabuf.h>
+#include <random>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace libcamera;
+
+SyntheticSource::SyntheticSource(unsigned int index, float fps, std::string const &jitter)
+	: index_(index), periodNs_(1e9 / fps), jitter_(Jitter::Off), jitterAmount_(0),
+	  udmabuf_(false), running_(false), starved_(0)
+{
+	std::string kind = jitter.substr(0, jitter.find(':'));
+	if (jitter.find(':') != std::string::npos)
+		jitterAmount_ = std::stoi(jitter.substr(jitter.find(':') + 1));
+
+	if (kind == "uniform")
+		jitter_ = Jitter::Uniform;
+	else if (kind == "burst" && jitterAmount_ > 0)
+		jitter_ = Jitter::Burst;
+	else if (kind != "none" && !kind.empty())
+		throw std::runtime_error("unknown jitter pattern: " + jitter);
+}
+
+SyntheticSource::~SyntheticSource()
+{
+	stop();
+	freeBuffers();
+}
+
+static int exportDmabuf(int memfd, size_t size)
+{
+	int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (dev < 0)
+		return -1;
+
+	struct udmabuf_create create = {};
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+	int fd = ioctl(dev, UDMABUF_CREATE, &create);
+	close(dev);
+	return fd;
+}
+
+void SyntheticSource::configure(unsigned int width, unsigned int height, int bufferCount)
+{
+	freeBuffers();
+
+	config_.pixelFormat = formats::YUV420;
+	config_.size = Size(width ? width : 1280, height ? height : 960);
+	config_.stride = (config_.size.width + 63) & ~63;
+	config_.frameSize = config_.stride * config_.size.height * 3 / 2;
+	config_.bufferCount = bufferCount;
+	if (trace_)
+		trace_->mark(index_, StartupTrace::Configured);
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (config_.frameSize + page - 1) & ~(page - 1);
+	unsigned int y_size = config_.stride * config_.size.height;
+	unsigned int uv_size = y_size / 4;
+
+	free_ = std::make_unique<CompletionQueue<unsigned int>>(bufferCount);
+	udmabuf_ = true;
+	for (int i = 0; i < bufferCount; i++) {
+		int memfd = memfd_create("simple-cam-synthetic", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (memfd < 0 || ftruncate(memfd, size) < 0) {
+			if (memfd >= 0)
+				close(memfd);
+			freeBuffers();
+			throw std::runtime_error("failed to allocate synthetic buffer");
+		}
+
+		// udmabuf needs the memfd to be unshrinkable.
+		fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+		int fd = exportDmabuf(memfd, size);
+		if (fd < 0) {
+			fd = memfd;
+			udmabuf_ = false;
+		} else {
+			close(memfd);
+		}
+
+		void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (memory == MAP_FAILED) {
+			close(fd);
+			freeBuffers();
+			throw std::runtime_error("failed to map synthetic buffer");
+		}
+
+		// Mid-grey with a per-buffer shade, so reuse is visible.
+		uint8_t *data = static_cast<uint8_t *>(memory);
+		memset(data, 64 + (i * 32) % 128, y_size);
+		memset(data + y_size, 128, 2 * uv_size);
+
+		std::vector<FrameBuffer::Plane> planes(3);
+		planes[0] = { SharedFD(fd), 0, y_size };
+		planes[1] = { SharedFD(fd), y_size, uv_size };
+		planes[2] = { SharedFD(fd), y_size + uv_size, uv_size };
+
+		Buffer buffer;
+		buffer.fd = fd;
+		buffer.size = size;
+		buffer.buffer = std::make_unique<FrameBuffer>(planes, i);
+		buffer.mapping.push_back(Span<uint8_t>(data, size));
+		buffers_.push_back(std::move(buffer));
+		free_->push(i);
+	}
+	if (trace_)
+		trace_->mark(index_, StartupTrace::Allocated);
+
+	std::cout << "Synthetic source " << index_ << ": " << bufferCount << " buffers of "
+		  << config_.size.width << "x" << config_.size.height << " YUV420 ("
+		  << (udmabuf_ ? "udmabuf" : "memfd, no dmabuf export") << ")" << std::endl;
+}
+
+void SyntheticSource::freeBuffers()
+{
+	for (Buffer &buffer : buffers_) {
+		munmap(buffer.mapping[0].data(), buffer.size);
+		close(buffer.fd);
+	}
+	buffers_.clear();
+}
+
+void SyntheticSource::report() const
+{
+	if (starved_)
+		std::cout << "Synthetic source " << index_ << ": " << starved_
+			  << " frames skipped with no free buffer" << std::endl;
+}
+
+void SyntheticSource::start(const ControlList &controls)
+{
+	running_ = true;
+	thread_ = std::thread(&SyntheticSource::run, this);
+}
+
+void SyntheticSource::stop()
+{
+	running_ = false;
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void SyntheticSource::release(unsigned int slot)
+{
+	free_->push(slot);
+}
+
+std::vector<Span<uint8_t>> const &SyntheticSource::mappedBuffer(FrameBuffer *buffer)
+{
+	return buffers_[buffer->cookie()].mapping;
+}
+
+void SyntheticSource::run()
+{
+	// Fixed seed per source so that runs are reproducible.
+	std::mt19937 random(index_ + 1);
+	std::uniform_int_distribution<int64_t> spread(-(int64_t)jitterAmount_ * 1000, jitterAmount_ * 1000);
+
+	uint64_t next = latencyNow();
+	uint32_t sequence = 0;
+
+	while (running_.load(std::memory_order_relaxed)) {
+		next += periodNs_;
+		uint64_t deliver = next;
+		if (jitter_ == Jitter::Uniform)
+			deliver += spread(random);
+		else if (jitter_ == Jitter::Burst && sequence % jitterAmount_ == jitterAmount_ - 1)
+			deliver += periodNs_; // held back, arrives with the next frame
+
+		struct timespec ts = { (time_t)(deliver / 1000000000), (long)(deliver % 1000000000) };
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+
+		unsigned int slot;
+		if (!free_->pop(slot)) {
+			/* Same as a sensor with no queued buffer: the frame is lost. */
+			starved_.fetch_add(1, std::memory_order_relaxed);
+			sequence++;
+			continue;
+		}
+		TRACE_SCOPE("syntheticComplete");
+
+		/* Stamp the first rows so that consecutive frames differ. */
+		Buffer &buffer = buffers_[slot];
+		memset(buffer.mapping[0].data(), sequence & 0xff, config_.stride * 16);
+
+		Frame frame = {
+			index_,
+			slot,
+			buffer.buffer.get(),
+			&config_,
+			next, // the "sensor" time, before any delivery jitter
+			sequence++,
+		};
+		completed_(frame);
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "completion_queue.h"
+#include "frame_source.h"
+
+/*
+ * Generates YUV420 frames at a fixed rate, with optional timing jitter, into
+ * memfd buffers that are exported as dmabufs through /dev/udmabuf when the
+ * kernel provides it (plain memfds otherwise, which only CPU consumers can
+ * use, see dmabuf()). Frames feed the same completion path
+ * as a real camera, so the event loop, synchronisation and rendering can be
+ * benchmarked without hardware.
+ *
+ * Jitter is "none", "uniform:<us>" (each frame early or late by up to that
+ * much) or "burst:<n>" (every n-th frame arrives together with the next).
+ */
+class SyntheticSource : public FrameSource
+{
+public:
+	SyntheticSource(unsigned int index, float fps, std::string const &jitter);
+	~SyntheticSource();
+
+	void configure(unsigned int width, unsigned int height, int bufferCount) override;
+	void start(const libcamera::ControlList &controls) override;
+	void stop() override;
+
+	libcamera::StreamConfiguration const &streamConfiguration() const override { return config_; }
+	unsigned int slots() const override { return buffers_.size(); }
+	void release(unsigned int slot) override;
+
+	std::vector<libcamera::Span<uint8_t>> const &mappedBuffer(libcamera::FrameBuffer *buffer) override;
+
+	bool dmabuf() const override { return udmabuf_; }
+	void report() const override;
+
+private:
+	enum class Jitter { Off, Uniform, Burst };
+
+	struct Buffer
+	{
+		int fd;
+		size_t size;
+		std::unique_ptr<libcamera::FrameBuffer> buffer;
+		std::vector<libcamera::Span<uint8_t>> mapping;
+	};
+
+	void freeBuffers();
+	void run();
+
+	unsigned int index_;
+	uint64_t periodNs_;
+	Jitter jitter_;
+	unsigned int jitterAmount_;
+
+	libcamera::StreamConfiguration config_;
+	std::vector<Buffer> buffers_;
+	bool udmabuf_;
+	std::unique_ptr<CompletionQueue<unsigned int>> free_;
+
+	std::thread thread_;
+	std::atomic<bool> running_;
+	std::atomic<uint64_t> starved_; // skipped, every buffer still held downstream
+};
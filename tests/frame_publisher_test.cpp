@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * frame_publisher_test.cpp - A subscriber that stalls with no new frames
+ * coming is still disconnected and its frame handed back
+ */
+
+#include <iostream>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "frame_publisher.h"
+#include "latency.h"
+
+using namespace libcamera;
+
+static constexpr unsigned int kWidth = 64;
+static constexpr unsigned int kHeight = 48;
+static constexpr unsigned int kTimeoutMs = 100;
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+	if (!condition) {
+		std::cerr << "FAIL: " << what << std::endl;
+		failures++;
+	}
+}
+
+int main()
+{
+	std::string path = "/tmp/simple-cam-publisher-test-" + std::to_string(getpid());
+
+	StreamConfiguration config;
+	config.pixelFormat = formats::YUV420;
+	config.size = { kWidth, kHeight };
+	config.stride = kWidth;
+	config.frameSize = kWidth * kHeight * 3 / 2;
+
+	int memfd = memfd_create("publisher-test", MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, config.frameSize) < 0) {
+		std::cerr << "failed to create buffer" << std::endl;
+		return 1;
+	}
+
+	unsigned int luma = kWidth * kHeight;
+	std::vector<FrameBuffer::Plane> planes = {
+		{ SharedFD(memfd), 0, luma },
+		{ SharedFD(memfd), luma, luma / 4 },
+		{ SharedFD(memfd), luma * 5 / 4, luma / 4 },
+	};
+	std::unique_ptr<FrameBuffer> buffer = std::make_unique<FrameBuffer>(planes, 0);
+	Frame frame = { 0, 0, buffer.get(), &config, 0, 0 };
+
+	EventLoop loop;
+	unsigned int holders = 0;
+	unsigned int releases = 0;
+	uint64_t published = 0;
+	uint64_t released = 0;
+
+	{
+		FramePublisher publisher(loop, path, 1, 1, kTimeoutMs);
+		publisher.onRelease([&](const Frame &) {
+			released = latencyNow();
+			releases++;
+			loop.exit();
+		});
+
+		/* A subscriber that takes its frame and never gives it back. */
+		int client = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		struct sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+		if (client < 0 || connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			std::cerr << "failed to connect to " << path << std::endl;
+			return 1;
+		}
+
+		/* One frame once the subscriber is accepted, then capture stalls. */
+		int publishFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct itimerspec once = {};
+		once.it_value.tv_nsec = 20000000;
+		timerfd_settime(publishFd, 0, &once, nullptr);
+		loop.addWatch(publishFd, [&]() {
+			uint64_t expirations;
+			if (read(publishFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				return;
+			published = latencyNow();
+			holders = publisher.publish(frame);
+		});
+
+		loop.timeout(2);
+		loop.exec();
+
+		check(holders == 1, "subscriber was sent the frame");
+		check(releases == 1, "held frame was handed back");
+		check(released - published >= kTimeoutMs * 1000000ull, "frame was not taken back before the timeout");
+		check(released - published < (kTimeoutMs + 500) * 1000000ull, "frame was taken back soon after the timeout");
+
+		PublisherStats stats = publisher.stats();
+		check(stats.dropped == 1, "stalled subscriber was counted as dropped");
+		check(stats.subscribers == 0, "stalled subscriber was disconnected");
+
+		loop.removeWatch(publishFd);
+		close(publishFd);
+		close(client);
+	}
+
+	close(memfd);
+
+	if (failures)
+		return 1;
+
+	std::cout << "Stalled subscriber disconnected after "
+		  << (released - published) / 1000000 << " ms" << std::endl;
+	return 0;
+}
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * render_thread_test.cpp - A slow consumer behind a blocking mailbox of one
+ * still gets every frame set, with the event loop only woken for space
+ */
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "completion_queue.h"
+#include "event_loop.h"
+#include "preview.h"
+#include "render_thread.h"
+
+using namespace libcamera;
+
+static constexpr unsigned int kBuffers = 4;
+static constexpr unsigned int kFrames = 40;
+static constexpr unsigned int kFirstDrawMs = 200;
+static constexpr unsigned int kDrawMs = 5;
+
+/*
+ * The parts of the preview the render thread uses, with nothing on screen.
+ * A draw just takes its time; the first one much longer, as a first draw
+ * that compiles shaders and imports buffers does.
+ */
+static std::atomic<unsigned int> draws(0);
+
+void makeBuffer(int fd, StreamConfiguration const &cfg, FrameBuffer *buffer, int camera_num) {}
+void setAuxView(const uint8_t *gray, unsigned int width, unsigned int height) {}
+
+void displayFrame(int width, int height)
+{
+	unsigned int ms = draws++ ? kDrawMs : kFirstDrawMs;
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+PresentTiming lastPresentTiming() { return {}; }
+/* As without EGL_KHR_fence_sync: the GPU is already done. */
+EGLSyncKHR createFence() { return EGL_NO_SYNC_KHR; }
+bool waitFence(EGLSyncKHR fence, uint64_t timeout_ns) { return true; }
+void destroyFence(EGLSyncKHR fence) {}
+void scanoutBuffer(int camera_num, FrameBuffer *buffer, StreamConfiguration const &info) {}
+bool scanoutCommit() { return false; }
+void disableScanout() {}
+CpuTarget cpuTarget() { return {}; }
+void cpuPresent() {}
+void releasePreview() {}
+
+int main()
+{
+	StreamConfiguration config;
+	config.size = { 64, 48 };
+	config.stride = 64;
+
+	std::vector<FrameBuffer::Plane> planes(1);
+	std::vector<std::unique_ptr<FrameBuffer>> buffers;
+	for (unsigned int i = 0; i < kBuffers; i++)
+		buffers.push_back(std::make_unique<FrameBuffer>(planes, i));
+
+	EventLoop loop;
+	RenderThread render(1, 64, 48);
+	render.setMailbox(1, MailboxPolicy::Block);
+
+	/*
+	 * Drawn frames go straight back to the "camera" without waking the
+	 * loop, so once every buffer is held only the space handler can get
+	 * the refused sets offered again.
+	 */
+	CompletionQueue<unsigned int> free(kBuffers);
+	for (unsigned int i = 0; i < kBuffers; i++)
+		free.push(i);
+	std::atomic<unsigned int> released(0);
+	render.onRelease([&](const Frame &frame) {
+		free.push(frame.slot);
+		released++;
+	});
+	render.onSpace([&]() { loop.wakeup(); });
+
+	std::deque<std::vector<Frame>> backlog;
+	unsigned int produced = 0;
+	unsigned int refused = 0;
+	loop.onWakeup([&]() {
+		while (!backlog.empty() && render.submit(backlog.front()))
+			backlog.pop_front();
+
+		unsigned int slot;
+		while (produced < kFrames && free.pop(slot)) {
+			std::vector<Frame> set = { { 0, slot, buffers[slot].get(), &config, produced * 33333333ull, produced } };
+			produced++;
+			if (!backlog.empty() || !render.submit(set)) {
+				backlog.push_back(set);
+				refused++;
+			}
+		}
+
+		if (produced == kFrames && backlog.empty())
+			loop.exit();
+	});
+
+	render.start();
+	loop.wakeup();
+	loop.timeout(5);
+	auto start = std::chrono::steady_clock::now();
+	loop.exec();
+	/* The last set may still be being drawn. */
+	for (unsigned int i = 0; i < 100 && render.totalRendered() < produced; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	render.stop();
+
+	unsigned int failures = 0;
+	auto check = [&failures](bool condition, const char *what) {
+		if (!condition) {
+			std::cerr << "FAIL: " << what << std::endl;
+			failures++;
+		}
+	};
+
+	RenderStats stats = render.stats();
+	check(refused > 0, "the slow first draw filled the mailbox");
+	check(produced == kFrames && backlog.empty(), "every set was offered and taken");
+	check(render.totalRendered() == kFrames, "every set was drawn");
+	check(stats.superseded == 0, "no set was dropped");
+	check(released == kFrames, "every frame was handed back");
+	check(seconds < 3, "the pipeline kept moving");
+
+	if (failures) {
+		std::cerr << produced << " produced, " << render.totalRendered() << " drawn, "
+			  << backlog.size() << " waiting after " << seconds << "s" << std::endl;
+		return 1;
+	}
+
+	std::cout << kFrames << " sets drawn in " << seconds << "s, " << refused
+		  << " refused on the way" << std::endl;
+	return 0;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * yuv_convert_test.cpp - The SIMD row kernel gives the scalar one's output
+ * byte for byte, whatever the width and alignment
+ */
+
+#include <iostream>
+#include <random>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "yuv_convert.h"
+
+/* Written past the row, to catch a kernel that overruns it. */
+static constexpr unsigned int kGuard = 64;
+static constexpr uint8_t kGuardByte = 0xa5;
+
+static unsigned int failures = 0;
+
+static void compare(std::mt19937 &random, unsigned int width, unsigned int misalign)
+{
+	std::uniform_int_distribution<int> byte(0, 255);
+	unsigned int chroma = (width + 1) / 2;
+
+	/* Extremes too, where the 16-bit lanes saturate. */
+	std::vector<uint8_t> y(misalign + width), u(misalign + chroma), v(misalign + chroma);
+	for (unsigned int i = 0; i < y.size(); i++)
+		y[i] = i % 7 == 0 ? (i & 8 ? 255 : 0) : byte(random);
+	for (unsigned int i = 0; i < u.size(); i++) {
+		u[i] = i % 5 == 0 ? (i & 4 ? 255 : 0) : byte(random);
+		v[i] = i % 3 == 0 ? (i & 2 ? 255 : 0) : byte(random);
+	}
+
+	std::vector<uint8_t> expected(misalign + width * 4 + kGuard, kGuardByte);
+	std::vector<uint8_t> actual(expected.size(), kGuardByte);
+	convertRowScalar(y.data() + misalign, u.data() + misalign, v.data() + misalign,
+			 expected.data() + misalign, width);
+	convertRow(y.data() + misalign, u.data() + misalign, v.data() + misalign,
+		   actual.data() + misalign, width);
+
+	for (unsigned int i = misalign + width * 4; i < expected.size(); i++) {
+		if (expected[i] != kGuardByte || actual[i] != kGuardByte) {
+			std::cerr << "FAIL: width " << width << " wrote past the row" << std::endl;
+			failures++;
+			return;
+		}
+	}
+
+	if (memcmp(expected.data(), actual.data(), expected.size())) {
+		unsigned int i = 0;
+		while (expected[i] == actual[i])
+			i++;
+		std::cerr << "FAIL: width " << width << ", misaligned by " << misalign
+			  << ": pixel " << (i - misalign) / 4 << " channel " << (i - misalign) % 4
+			  << " is " << (int)actual[i] << ", scalar gives " << (int)expected[i] << std::endl;
+		failures++;
+	}
+}
+
+int main()
+{
+	std::mt19937 random(1);
+	unsigned int rows = 0;
+
+	/* Every tail length after the 16 and 32 pixel blocks, odd widths included. */
+	for (unsigned int width = 1; width <= 200; width++) {
+		for (unsigned int misalign = 0; misalign < 4; misalign++) {
+			compare(random, width, misalign);
+			rows++;
+		}
+	}
+
+	/* Full rows of common frame sizes, and a few random ones. */
+	for (unsigned int width : { 640u, 1280u, 1920u, 1921u, 4056u }) {
+		compare(random, width, 0);
+		rows++;
+	}
+	std::uniform_int_distribution<unsigned int> widths(1, 4096);
+	for (unsigned int i = 0; i < 200; i++) {
+		compare(random, widths(random), i % 4);
+		rows++;
+	}
+
+	if (failures)
+		return 1;
+
+	std::cout << convertKernel() << " matches the scalar kernel on " << rows << " rows" << std::endl;
+	return 0;
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * thread_pool.cpp - Split a job across a fixed set of threads
+ */
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int threads)
+	: stopping_(false), func_(nullptr), count_(0), generation_(0), next_(0), busy_(0)
+{
+	if (!threads)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned int i = 1; i < threads; i++)
+		workers_.emplace_back(&ThreadPool::run, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		stopping_ = true;
+	}
+	start_.notify_all();
+	for (std::thread &worker : workers_)
+		worker.join();
+}
+
+void ThreadPool::parallelFor(unsigned int count, const std::function<void(unsigned int)> &func)
+{
+	if (workers_.empty() || count < 2) {
+		for (unsigned int i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> locker(lock_);
+		func_ = &func;
+		count_ = count;
+		next_.store(0, std::memory_order_relaxed);
+		busy_ = workers_.size();
+		generation_++;
+	}
+	start_.notify_all();
+
+	work();
+
+	/* func has to outlive every worker that may still be calling it. */
+	std::unique_lock<std::mutex> locker(lock_);
+	done_.wait(locker, [this]() { return busy_ == 0; });
+	func_ = nullptr;
+}
+
+void ThreadPool::work()
+{
+	unsigned int i;
+	while ((i = next_.fetch_add(1, std::memory_order_relaxed)) < count_)
+		(*func_)(i);
+}
+
+void ThreadPool::run()
+{
+	uint64_t generation = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> locker(lock_);
+			start_.wait(locker, [this, generation]() { return stopping_ || generation_ != generation; });
+			if (stopping_)
+				return;
+			generation = generation_;
+		}
+
+		work();
+
+		std::unique_lock<std::mutex> locker(lock_);
+		if (--busy_ == 0)
+			done_.notify_one();
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed set of worker threads for splitting one job into independent
+ * pieces, such as the row bands of an image. parallelFor() hands out the
+ * indices to the workers and the calling thread alike and returns once all
+ * of them are done. Only one parallelFor() may run at a time.
+ */
+class ThreadPool
+{
+public:
+	/* threads == 0 uses one thread per CPU, the caller included. */
+	explicit ThreadPool(unsigned int threads = 0);
+	~ThreadPool();
+
+	/* Threads that work on a parallelFor(), the calling thread included. */
+	unsigned int size() const { return workers_.size() + 1; }
+
+	void parallelFor(unsigned int count, const std::function<void(unsigned int)> &func);
+
+private:
+	void run();
+	void work();
+
+	std::vector<std::thread> workers_;
+	std::mutex lock_;
+	std::condition_variable start_;
+	std::condition_variable done_;
+	bool stopping_;
+
+	/* The current job, valid while generation_ is ahead of a worker's. */
+	const std::function<void(unsigned int)> *func_;
+	unsigned int count_;
+	uint64_t generation_;
+	std::atomic<unsigned int> next_;
+	unsigned int busy_;
+};
@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * trace.cpp - Per-thread trace event buffers and their Chrome JSON dump
+ */
+
+#ifdef SIMPLE_CAM_TRACE
+
+#include "trace.h"
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent
+{
+	const char *name;
+	uint64_t timestamp; // latencyNow()
+	uint64_t arg;       // duration for slices, id for flows
+	char phase;         // 'X' slice, 's' flow begin, 'f' flow end
+};
+
+/*
+ * Only the owning thread writes events; count is published after each one,
+ * so the dump reads a consistent prefix even if the thread is still going.
+ */
+struct TraceBuffer
+{
+	std::unique_ptr<TraceEvent[]> events;
+	size_t capacity;
+	std::atomic<size_t> count;
+	std::atomic<uint64_t> lost;
+	pid_t tid;
+	std::string name; // under lock
+};
+
+static std::atomic<bool> enabled(false);
+static std::atomic<size_t> capacity(0);
+
+/* Buffers outlive their threads, so the dump still has their events. */
+static std::mutex lock;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+
+static thread_local TraceBuffer *current = nullptr;
+
+static TraceBuffer *threadBuffer()
+{
+	if (current)
+		return current;
+
+	std::unique_ptr<TraceBuffer> buffer = std::make_unique<TraceBuffer>();
+	buffer->capacity = capacity.load(std::memory_order_relaxed);
+	buffer->events = std::make_unique<TraceEvent[]>(buffer->capacity);
+	buffer->count = 0;
+	buffer->lost = 0;
+	buffer->tid = syscall(SYS_gettid);
+	char name[16] = {};
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+	buffer->name = name;
+
+	std::unique_lock<std::mutex> locker(lock);
+	current = buffer.get();
+	buffers.push_back(std::move(buffer));
+	return current;
+}
+
+static void record(const char *name, uint64_t timestamp, uint64_t arg, char phase)
+{
+	TraceBuffer *buffer = threadBuffer();
+	size_t count = buffer->count.load(std::memory_order_relaxed);
+	if (count == buffer->capacity) {
+		buffer->lost.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	buffer->events[count] = { name, timestamp, arg, phase };
+	buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void traceStart(size_t eventsPerThread)
+{
+	capacity = eventsPerThread;
+	enabled.store(true, std::memory_order_release);
+}
+
+bool traceEnabled()
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+void traceThreadName(const char *name)
+{
+	if (!traceEnabled())
+		return;
+
+	TraceBuffer *buffer = threadBuffer();
+	std::unique_lock<std::mutex> locker(lock);
+	buffer->name = name;
+}
+
+void traceComplete(const char *name, uint64_t start, uint64_t end)
+{
+	if (traceEnabled())
+		record(name, start, end - start, 'X');
+}
+
+void traceFlow(const char *name, uint64_t id, bool begin)
+{
+	if (traceEnabled())
+		record(name, latencyNow(), id, begin ? 's' : 'f');
+}
+
+TraceScope::TraceScope(const char *name)
+	: name_(name), start_(traceEnabled() ? latencyNow() : 0)
+{
+}
+
+TraceScope::~TraceScope()
+{
+	if (start_)
+		traceComplete(name_, start_, latencyNow());
+}
+
+/*
+ * Times are in microseconds from the first event, as the format wants, and
+ * every thread is in the one process.
+ */
+bool traceDump(std::string const &path)
+{
+	enabled.store(false, std::memory_order_relaxed);
+
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+		return false;
+
+	/* Threads still running may add more, which are left out. */
+	std::unique_lock<std::mutex> locker(lock);
+	std::vector<size_t> counts;
+	uint64_t origin = UINT64_MAX;
+	for (std::unique_ptr<TraceBuffer> &buffer : buffers) {
+		counts.push_back(buffer->count.load(std::memory_order_acquire));
+		for (size_t i = 0; i < counts.back(); i++)
+			origin = std::min(origin, buffer->events[i].timestamp);
+	}
+
+	int pid = getpid();
+	uint64_t lost = 0;
+	const char *separator = "";
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (unsigned int b = 0; b < buffers.size(); b++) {
+		TraceBuffer *buffer = buffers[b].get();
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			separator, pid, buffer->tid, buffer->name.c_str());
+		separator = ",";
+
+		for (size_t i = 0; i < counts[b]; i++) {
+			const TraceEvent &event = buffer->events[i];
+			double ts = (event.timestamp - origin) / 1000.0;
+			if (event.phase == 'X')
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"simple-cam\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+					event.name, ts, event.arg / 1000.0, pid, buffer->tid);
+			else
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"%c\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+					event.name, event.phase, (unsigned long long)event.arg, ts, pid, buffer->tid,
+					event.phase == 'f' ? ",\"bp\":\"e\"" : "");
+		}
+		lost += buffer->lost.load(std::memory_order_relaxed);
+	}
+	fprintf(file, "\n]}\n");
+
+	if (lost)
+		printf("Trace: %llu events lost to full thread buffers\n", (unsigned long long)lost);
+	return fclose(file) == 0;
+}
+
+#endif
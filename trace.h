@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+/*
+ * Timeline tracing in the Chrome trace-event format, for chrome://tracing
+ * or ui.perfetto.dev. Each thread records into a fixed buffer of its own,
+ * allocated on its first event and kept until exit, so recording takes no
+ * lock and no allocation: a scope costs two clock reads and a store. A full
+ * buffer loses its thread's later events, and the dump says how many.
+ *
+ * Nothing is recorded until traceStart(). Building with SIMPLE_CAM_TRACE
+ * off (cmake -DSIMPLE_CAM_TRACE=OFF) compiles the macros below, and so
+ * every trace point, out altogether.
+ */
+
+#ifdef SIMPLE_CAM_TRACE
+
+/* Events kept per thread, 32 bytes each. */
+void traceStart(size_t eventsPerThread);
+/* Stops recording and writes everything recorded. Returns false on errors. */
+bool traceDump(std::string const &path);
+/* How the calling thread is labelled, its kernel name by default. */
+void traceThreadName(const char *name);
+
+/* Names must be string literals, or otherwise outlive the dump. */
+void traceComplete(const char *name, uint64_t start, uint64_t end);
+void traceFlow(const char *name, uint64_t id, bool begin);
+bool traceEnabled();
+
+class TraceScope
+{
+public:
+	explicit TraceScope(const char *name);
+	~TraceScope();
+
+private:
+	const char *name_;
+	uint64_t start_;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+/* Flow arrows join the slices that enclose the begin and the end. */
+#define TRACE_FLOW_BEGIN(name, id) traceFlow(name, id, true)
+#define TRACE_FLOW_END(name, id) traceFlow(name, id, false)
+#define TRACE_THREAD(name) traceThreadName(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_FLOW_BEGIN(name, id) do {} while (0)
+#define TRACE_FLOW_END(name, id) do {} while (0)
+#define TRACE_THREAD(name) do {} while (0)
+
+#endif
+
+/* A camera's frame as a flow id, unique for the session. */
+static inline uint64_t traceFrameId(unsigned int camera, uint32_t sequence)
+{
+	return ((uint64_t)camera << 32) | sequence;
+}
@@ -0,0 +1,387 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2022, Peyton Howe
+ *
+ * yuv_convert.cpp - Convert and compose YUV420 frames on the CPU
+ */
+
+#include "yuv_convert.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_CONVERT_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define YUV_CONVERT_NEON
+#endif
+
+using namespace libcamera;
+
+/*
+ * BT.601 narrow range in 6 fractional bits, small enough for every term to
+ * fit 16-bit lanes: the luma term stays within +-17718, chroma within
+ * +-16512, and sums that overflow saturate to values that clamp the same.
+ */
+static constexpr int kYMul = 74;  // 1.164
+static constexpr int kRV = 102;   // 1.596
+static constexpr int kGU = -25;   // -0.391
+static constexpr int kGV = -52;   // -0.813
+static constexpr int kBU = 129;   // 2.018
+static constexpr int kRound = 32;
+
+static inline uint8_t clamp(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+void convertRowScalar(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+	for (unsigned int x = 0; x < width; x += 2) {
+		int d = u[x / 2] - 128;
+		int e = v[x / 2] - 128;
+		int r = kRV * e;
+		int g = kGU * d + kGV * e;
+		int b = kBU * d;
+
+		/* An odd width leaves a last pixel with its chroma to itself. */
+		for (unsigned int i = 0; i < 2 && x + i < width; i++) {
+			int l = (y[x + i] - 16) * kYMul + kRound;
+			dst[0] = clamp((l + b) >> 6);
+			dst[1] = clamp((l + g) >> 6);
+			dst[2] = clamp((l + r) >> 6);
+			dst[3] = 255;
+			dst += 4;
+		}
+	}
+}
+
+#ifdef YUV_CONVERT_X86
+
+__attribute__((target("sse4.1")))
+static void convertRowSse41(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+	const __m128i yOffset = _mm_set1_epi16(16);
+	const __m128i cOffset = _mm_set1_epi16(128);
+	const __m128i yMul = _mm_set1_epi16(kYMul);
+	const __m128i round = _mm_set1_epi16(kRound);
+	const __m128i rv = _mm_set1_epi16(kRV);
+	const __m128i gu = _mm_set1_epi16(kGU);
+	const __m128i gv = _mm_set1_epi16(kGV);
+	const __m128i bu = _mm_set1_epi16(kBU);
+	const __m128i alpha = _mm_set1_epi8(-1);
+
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i yy = _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+		__m128i uu = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(u + x / 2)));
+		__m128i vv = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(v + x / 2)));
+		uu = _mm_sub_epi16(uu, cOffset);
+		vv = _mm_sub_epi16(vv, cOffset);
+
+		__m128i yLo = _mm_cvtepu8_epi16(yy);
+		__m128i yHi = _mm_cvtepu8_epi16(_mm_srli_si128(yy, 8));
+		yLo = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(yLo, yOffset), yMul), round);
+		yHi = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(yHi, yOffset), yMul), round);
+
+		/* One chroma term per pixel pair, duplicated across the pair. */
+		__m128i r = _mm_mullo_epi16(vv, rv);
+		__m128i g = _mm_add_epi16(_mm_mullo_epi16(uu, gu), _mm_mullo_epi16(vv, gv));
+		__m128i b = _mm_mullo_epi16(uu, bu);
+
+		__m128i R = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yLo, _mm_unpacklo_epi16(r, r)), 6),
+					     _mm_srai_epi16(_mm_adds_epi16(yHi, _mm_unpackhi_epi16(r, r)), 6));
+		__m128i G = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yLo, _mm_unpacklo_epi16(g, g)), 6),
+					     _mm_srai_epi16(_mm_adds_epi16(yHi, _mm_unpackhi_epi16(g, g)), 6));
+		__m128i B = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yLo, _mm_unpacklo_epi16(b, b)), 6),
+					     _mm_srai_epi16(_mm_adds_epi16(yHi, _mm_unpackhi_epi16(b, b)), 6));
+
+		__m128i bgLo = _mm_unpacklo_epi8(B, G);
+		__m128i bgHi = _mm_unpackhi_epi8(B, G);
+		__m128i rxLo = _mm_unpacklo_epi8(R, alpha);
+		__m128i rxHi = _mm_unpackhi_epi8(R, alpha);
+		__m128i *out = reinterpret_cast<__m128i *>(dst + x * 4);
+		_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(bgLo, rxLo));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bgLo, rxLo));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bgHi, rxHi));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bgHi, rxHi));
+	}
+
+	convertRowScalar(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x);
+}
+
+/* Pixels 0-15 and 16-31 of an in-order 16-bit chroma term, each value doubled. */
+__attribute__((target("avx2")))
+static inline void duplicate(__m256i c, __m256i &lo, __m256i &hi)
+{
+	__m256i a = _mm256_unpacklo_epi16(c, c);
+	__m256i b = _mm256_unpackhi_epi16(c, c);
+	lo = _mm256_permute2x128_si256(a, b, 0x20);
+	hi = _mm256_permute2x128_si256(a, b, 0x31);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i channel(__m256i yLo, __m256i yHi, __m256i c)
+{
+	__m256i lo, hi;
+	duplicate(c, lo, hi);
+	__m256i packed = _mm256_packus_epi16(_mm256_srai_epi16(_mm256_adds_epi16(yLo, lo), 6),
+					     _mm256_srai_epi16(_mm256_adds_epi16(yHi, hi), 6));
+	/* packus works within 128-bit lanes, put the quarters back in order. */
+	return _mm256_permute4x64_epi64(packed, 0xd8);
+}
+
+__attribute__((target("avx2")))
+static void convertRowAvx2(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+	const __m256i yOffset = _mm256_set1_epi16(16);
+	const __m256i cOffset = _mm256_set1_epi16(128);
+	const __m256i yMul = _mm256_set1_epi16(kYMul);
+	const __m256i round = _mm256_set1_epi16(kRound);
+	const __m256i rv = _mm256_set1_epi16(kRV);
+	const __m256i gu = _mm256_set1_epi16(kGU);
+	const __m256i gv = _mm256_set1_epi16(kGV);
+	const __m256i bu = _mm256_set1_epi16(kBU);
+	const __m256i alpha = _mm256_set1_epi8(-1);
+
+	unsigned int x = 0;
+	for (; x + 32 <= width; x += 32) {
+		__m256i yy = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(y + x));
+		__m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(u + x / 2)));
+		__m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(v + x / 2)));
+		uu = _mm256_sub_epi16(uu, cOffset);
+		vv = _mm256_sub_epi16(vv, cOffset);
+
+		__m256i yLo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(yy));
+		__m256i yHi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(yy, 1));
+		yLo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(yLo, yOffset), yMul), round);
+		yHi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(yHi, yOffset), yMul), round);
+
+		__m256i R = channel(yLo, yHi, _mm256_mullo_epi16(vv, rv));
+		__m256i G = channel(yLo, yHi, _mm256_add_epi16(_mm256_mullo_epi16(uu, gu), _mm256_mullo_epi16(vv, gv)));
+		__m256i B = channel(yLo, yHi, _mm256_mullo_epi16(uu, bu));
+
+		/*
+		 * The unpacks also stay within lanes: p0-p3 hold pixels 0-3, 4-7,
+		 * 8-11 and 12-15 in their low lanes and 16 more in the high ones.
+		 */
+		__m256i bgLo = _mm256_unpacklo_epi8(B, G);
+		__m256i bgHi = _mm256_unpackhi_epi8(B, G);
+		__m256i rxLo = _mm256_unpacklo_epi8(R, alpha);
+		__m256i rxHi = _mm256_unpackhi_epi8(R, alpha);
+		__m256i p0 = _mm256_unpacklo_epi16(bgLo, rxLo);
+		__m256i p1 = _mm256_unpackhi_epi16(bgLo, rxLo);
+		__m256i p2 = _mm256_unpacklo_epi16(bgHi, rxHi);
+		__m256i p3 = _mm256_unpackhi_epi16(bgHi, rxHi);
+
+		__m256i *out = reinterpret_cast<__m256i *>(dst + x * 4);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+		_mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+	}
+
+	convertRowSse41(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x);
+}
+
+#endif /* YUV_CONVERT_X86 */
+
+#ifdef YUV_CONVERT_NEON
+
+static void convertRowNeon(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+	unsigned int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t yy = vld1q_u8(y + x);
+		/* The subtractions wrap in 16 bits, which reads back as signed. */
+		int16x8_t uu = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + x / 2), vdup_n_u8(128)));
+		int16x8_t vv = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + x / 2), vdup_n_u8(128)));
+		int16x8_t yLo = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(yy), vdup_n_u8(16)));
+		int16x8_t yHi = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(yy), vdup_n_u8(16)));
+		yLo = vmlaq_n_s16(vdupq_n_s16(kRound), yLo, kYMul);
+		yHi = vmlaq_n_s16(vdupq_n_s16(kRound), yHi, kYMul);
+
+		int16x8x2_t r = vzipq_s16(vmulq_n_s16(vv, kRV), vmulq_n_s16(vv, kRV));
+		int16x8_t gc = vmlaq_n_s16(vmulq_n_s16(uu, kGU), vv, kGV);
+		int16x8x2_t g = vzipq_s16(gc, gc);
+		int16x8x2_t b = vzipq_s16(vmulq_n_s16(uu, kBU), vmulq_n_s16(uu, kBU));
+
+		uint8x16x4_t pixels;
+		pixels.val[0] = vcombine_u8(vqshrun_n_s16(vqaddq_s16(yLo, b.val[0]), 6),
+					    vqshrun_n_s16(vqaddq_s16(yHi, b.val[1]), 6));
+		pixels.val[1] = vcombine_u8(vqshrun_n_s16(vqaddq_s16(yLo, g.val[0]), 6),
+					    vqshrun_n_s16(vqaddq_s16(yHi, g.val[1]), 6));
+		pixels.val[2] = vcombine_u8(vqshrun_n_s16(vqaddq_s16(yLo, r.val[0]), 6),
+					    vqshrun_n_s16(vqaddq_s16(yHi, r.val[1]), 6));
+		pixels.val[3] = vdupq_n_u8(255);
+		vst4q_u8(dst + x * 4, pixels);
+	}
+
+	convertRowScalar(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x);
+}
+
+#endif /* YUV_CONVERT_NEON */
+
+using RowConverter = void (*)(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, unsigned int);
+
+static RowConverter selectKernel(const char **name)
+{
+#if defined(YUV_CONVERT_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "AVX2";
+		return convertRowAvx2;
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		*name = "SSE4.1";
+		return convertRowSse41;
+	}
+#elif defined(YUV_CONVERT_NEON)
+	*name = "NEON";
+	return convertRowNeon;
+#endif
+	*name = "scalar";
+	return convertRowScalar;
+}
+
+static const char *kernel_name;
+static const RowConverter kernel = selectKernel(&kernel_name);
+
+void convertRow(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width)
+{
+	kernel(y, u, v, dst, width);
+}
+
+const char *convertKernel()
+{
+	return kernel_name;
+}
+
+YuvImage yuvImage(StreamConfiguration const &config, std::vector<Span<uint8_t>> const &mapping)
+{
+	YuvImage image = { nullptr, nullptr, nullptr, config.size.width, config.size.height, config.stride };
+	if (mapping.empty())
+		return image;
+
+	size_t ySize = (size_t)config.stride * config.size.height;
+	size_t cSize = ySize / 4;
+	image.y = mapping[0].data();
+	if (mapping.size() >= 3) {
+		image.u = mapping[1].data();
+		image.v = mapping[2].data();
+	} else if (mapping[0].size() >= ySize + 2 * cSize) {
+		image.u = image.y + ySize;
+		image.v = image.u + cSize;
+	} else
+		image.y = nullptr;
+
+	return image;
+}
+
+CpuCompositor::CpuCompositor(ThreadPool &pool)
+	: pool_(pool), data_(nullptr), width_(0), height_(0), stride_(0)
+{
+}
+
+void CpuCompositor::setOutput(uint8_t *data, unsigned int width, unsigned int height, unsigned int stride)
+{
+	if (width != width_ || height != height_)
+		cells_.clear();
+	data_ = data;
+	width_ = width;
+	height_ = height;
+	stride_ = stride;
+}
+
+void CpuCompositor::layout(std::vector<YuvImage> const &images)
+{
+	unsigned int count = images.size();
+	if (cells_.size() != count) {
+		unsigned int cols = 1;
+		while (cols * cols < count)
+			cols++;
+		unsigned int rows = count ? (count + cols - 1) / cols : 1;
+
+		cells_.assign(count, Cell{});
+		for (unsigned int i = 0; i < count; i++) {
+			Cell &cell = cells_[i];
+			/* Even widths, so pixel pairs never straddle two cells. */
+			cell.width = (width_ / cols) & ~1u;
+			cell.height = height_ / rows;
+			cell.x = (i % cols) * cell.width;
+			cell.y = (i / cols) * cell.height;
+		}
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		Cell &cell = cells_[i];
+		if (!images[i].y || cell.sourceWidth == images[i].width)
+			continue;
+
+		/* Columns only change with the camera's size, keep the map. */
+		cell.sourceWidth = images[i].width;
+		cell.columns.resize(cell.width);
+		for (unsigned int x = 0; x < cell.width; x++)
+			cell.columns[x] = (uint64_t)x * cell.sourceWidth / cell.width;
+	}
+}
+
+void CpuCompositor::draw(std::vector<YuvImage> const &images)
+{
+	if (!data_)
+		return;
+
+	layout(images);
+
+	/* A few bands per thread evens out cells that cost more than others. */
+	unsigned int bands = std::min(height_, pool_.size() * 4);
+	pool_.parallelFor(bands, [this, &images, bands](unsigned int band) {
+		drawBand(images, height_ * band / bands, height_ * (band + 1) / bands);
+	});
+}
+
+void CpuCompositor::drawBand(std::vector<YuvImage> const &images, unsigned int top, unsigned int bottom)
+{
+	/* Gathered rows for scaled cells, allocated once per thread. */
+	thread_local std::vector<uint8_t> yRow, uRow, vRow;
+
+	for (unsigned int i = 0; i < images.size(); i++) {
+		YuvImage const &image = images[i];
+		Cell const &cell = cells_[i];
+		if (!image.y || !cell.width || !cell.height)
+			continue;
+
+		unsigned int first = std::max(top, cell.y);
+		unsigned int last = std::min(bottom, cell.y + cell.height);
+		bool direct = cell.width == image.width;
+		if (!direct && yRow.size() < cell.width) {
+			yRow.resize(cell.width);
+			uRow.resize(cell.width / 2);
+			vRow.resize(cell.width / 2);
+		}
+
+		for (unsigned int row = first; row < last; row++) {
+			unsigned int sy = (uint64_t)(row - cell.y) * image.height / cell.height;
+			const uint8_t *y = image.y + (size_t)sy * image.stride;
+			const uint8_t *u = image.u + (size_t)(sy / 2) * (image.stride / 2);
+			const uint8_t *v = image.v + (size_t)(sy / 2) * (image.stride / 2);
+			uint8_t *dst = data_ + (size_t)row * stride_ + cell.x * 4;
+
+			if (direct) {
+				convertRow(y, u, v, dst, cell.width);
+				continue;
+			}
+
+			for (unsigned int x = 0; x < cell.width; x += 2) {
+				unsigned int sx = cell.columns[x];
+				yRow[x] = y[sx];
+				yRow[x + 1] = y[cell.columns[x + 1]];
+				uRow[x / 2] = u[sx / 2];
+				vRow[x / 2] = v[sx / 2];
+			}
+			convertRow(yRow.data(), uRow.data(), vRow.data(), dst, cell.width);
+		}
+	}
+}
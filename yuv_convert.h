@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+class ThreadPool;
+
+/* A YUV420 frame in memory: chroma planes are half size with half the stride. */
+struct YuvImage
+{
+	const uint8_t *y;
+	const uint8_t *u;
+	const uint8_t *v;
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+};
+
+/* Locate the planes of a mapped buffer laid out as libcamera allocates them. */
+YuvImage yuvImage(libcamera::StreamConfiguration const &config,
+		  std::vector<libcamera::Span<uint8_t>> const &mapping);
+
+/*
+ * Convert one row of pixels from BT.601 narrow range YUV to XRGB8888 (B, G,
+ * R, X in memory), the format of DRM dumb buffers and 24-bit X11 images.
+ * u and v hold one sample per two pixels, rounded up for an odd width. Uses
+ * the best of AVX2, SSE4.1 or NEON the CPU offers; every kernel gives
+ * exactly the same result as the scalar one.
+ */
+void convertRow(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width);
+void convertRowScalar(const uint8_t *y, const uint8_t *u, const uint8_t *v, uint8_t *dst, unsigned int width);
+const char *convertKernel();
+
+/*
+ * Draws camera frames into an XRGB8888 buffer in the same near-square grid
+ * as the GL preview, scaling each one to its cell with nearest neighbour
+ * sampling. The output is split into row bands that are converted in
+ * parallel on the pool.
+ */
+class CpuCompositor
+{
+public:
+	explicit CpuCompositor(ThreadPool &pool);
+
+	void setOutput(uint8_t *data, unsigned int width, unsigned int height, unsigned int stride);
+
+	/* Cameras whose image has a null y plane keep what their cell showed. */
+	void draw(std::vector<YuvImage> const &images);
+
+private:
+	struct Cell
+	{
+		unsigned int x, y, width, height;
+		std::vector<unsigned int> columns; // source column of each output column
+		unsigned int sourceWidth;
+	};
+
+	void layout(std::vector<YuvImage> const &images);
+	void drawBand(std::vector<YuvImage> const &images, unsigned int top, unsigned int bottom);
+
+	ThreadPool &pool_;
+	uint8_t *data_;
+	unsigned int width_;
+	unsigned int height_;
+	unsigned int stride_;
+	std::vector<Cell> cells_;
+};